@@ -0,0 +1,78 @@
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+#include "arena.h"
+
+// Smallest buffer, enough for the levels of a 128x128 texture
+static constexpr std::size_t min_capacity = std::size_t{1} << 16;
+
+scratch_arena& scratch_arena::local() noexcept
+{
+	thread_local scratch_arena arena;
+	return arena;
+}
+
+scratch_arena::scope::scope() noexcept
+	: arena{local()}
+{
+	++arena.depth;
+}
+
+scratch_arena::scope::~scope() noexcept
+{
+	if (--arena.depth == 0)
+		arena.reset();
+}
+
+void* scratch_arena::do_allocate(const std::size_t bytes,
+                                 const std::size_t alignment)
+{
+	const auto base = reinterpret_cast<std::uintptr_t>(buffer.get());
+	const std::uintptr_t end = base + used;
+	const std::uintptr_t at = (end + alignment - 1) & ~(alignment - 1);
+	const std::size_t offset = at - base;
+	if (buffer && offset <= capacity && bytes <= capacity - offset) {
+		used = offset + bytes;
+		return reinterpret_cast<void*>(at);
+	}
+	overflow += bytes + alignment;
+	return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void scratch_arena::do_deallocate(void* const p, const std::size_t bytes,
+                                  const std::size_t alignment)
+{
+	const auto base = reinterpret_cast<std::uintptr_t>(buffer.get());
+	const auto at = reinterpret_cast<std::uintptr_t>(p);
+	if (!buffer || at < base || at >= base + capacity) {
+		std::pmr::new_delete_resource()->deallocate(p, bytes,
+		                                            alignment);
+	}
+}
+
+bool scratch_arena::do_is_equal(const memory_resource& other) const noexcept
+{
+	return this == &other;
+}
+
+// Everything in the buffer is dead, and what overflowed was given back
+void scratch_arena::reset()
+{
+	const std::size_t wanted = used + overflow;
+	used = 0;
+	overflow = 0;
+	if (wanted <= capacity)
+		return;
+	std::size_t c = min_capacity;
+	while (c < wanted)
+		c *= 2;
+	try {
+		buffer.reset(new std::byte[c]);
+		capacity = c;
+	} catch (const std::bad_alloc&) {
+		// Scratch keeps going to the global allocator instead
+	}
+}
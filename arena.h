@@ -0,0 +1,52 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+/*
+ * Bump allocator for the scratch buffers of one lump, one per thread. Freeing
+ * does nothing until the outermost scope ends, which takes back everything at
+ * once. What does not fit goes to the global allocator, and the buffer grows
+ * to fit it next time, so that a run soon stops allocating scratch at all.
+ */
+class scratch_arena final : public std::pmr::memory_resource {
+public:
+	scratch_arena() = default;
+	scratch_arena(const scratch_arena&) = delete;
+	scratch_arena& operator=(const scratch_arena&) = delete;
+	~scratch_arena() noexcept override = default;
+
+	// Arena of the calling thread
+	[[nodiscard]] static scratch_arena& local() noexcept;
+
+	// Scratch allocated on the thread must not outlive the outermost scope
+	class scope {
+	public:
+		scope() noexcept;
+		scope(const scope&) = delete;
+		scope& operator=(const scope&) = delete;
+		~scope() noexcept;
+
+	private:
+		scratch_arena& arena;
+	};
+
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment)
+		override;
+	[[nodiscard]] bool do_is_equal(const memory_resource& other)
+		const noexcept override;
+
+	void reset();
+
+	std::unique_ptr<std::byte[]> buffer{};
+	std::size_t capacity = 0;
+	std::size_t used = 0;
+	std::size_t overflow = 0; // bytes that did not fit since the reset
+	unsigned int depth = 0;
+};
+
+#endif
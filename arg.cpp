@@ -1,4 +1,5 @@
 #include <cstring>
+#include <string_view>
 
 #include "arg.h"
 
@@ -11,6 +12,8 @@ int argument_parser::operator()() noexcept
 		++optind;
 		return -1;
 	}
+	if (arg[1] == '-' && argit == nullptr)
+		return parse_long(arg);
 	if (argit == nullptr)
 		argit = &arg[1];
 	const char* const c = std::strchr(optstring, *argit);
@@ -43,3 +46,33 @@ int argument_parser::operator()() noexcept
 		return *c;
 	}
 }
+
+int argument_parser::parse_long(const std::string_view arg) noexcept
+{
+	const std::size_t eq = arg.find('=');
+	const std::string_view name = arg.substr(2, eq - 2);
+	++optind;
+	longerr = {};
+	optarg = nullptr;
+	for (std::size_t i = 0; i < num_longopts; ++i) {
+		const long_option& o = longopts[i];
+		if (o.name != name)
+			continue;
+		if (!o.has_argument && eq != std::string_view::npos)
+			break;
+		if (o.has_argument && eq != std::string_view::npos) {
+			optarg = arg.data() + eq + 1;
+		} else if (o.has_argument) {
+			optarg = argv[optind];
+			if (optind++ >= argc) {
+				longerr = arg;
+				optopt = 0;
+				return optstring[0] == ':' ? ':' : '?';
+			}
+		}
+		return o.value;
+	}
+	longerr = arg.substr(0, eq);
+	optopt = 0;
+	return '?';
+}
@@ -1,9 +1,17 @@
 #ifndef ARG_H
 #define ARG_H
 
+#include <cstddef>
 #include <string_view>
 
-// Class version of POSIX getopt()
+// Option spelled --name or --name=argument, reported as value when found
+struct long_option {
+	std::string_view name;
+	bool has_argument;
+	int value;
+};
+
+// Class version of POSIX getopt(), with GNU-style long options
 class argument_parser {
 public:
 	argument_parser() = delete;
@@ -15,6 +23,18 @@ public:
 		: argc{c}
 		, argv{v}
 		, optstring{s}
+		, longopts{nullptr}
+		, num_longopts{0}
+	{}
+
+	template<std::size_t N>
+	constexpr argument_parser(int c, char* const v[], const char* s,
+	                          const long_option (&l)[N]) noexcept
+		: argc{c}
+		, argv{v}
+		, optstring{s}
+		, longopts{l}
+		, num_longopts{N}
 	{}
 
 	[[nodiscard]] int operator()() noexcept;
@@ -26,15 +46,25 @@ public:
 	[[nodiscard]] constexpr char error() const noexcept { return optopt; }
 	[[nodiscard]] constexpr int operand() const noexcept { return optind; }
 
+	// Spelling of the option error() refers to, long or not
+	[[nodiscard]] constexpr std::string_view error_name() const noexcept {
+		return longerr.empty() ? std::string_view(&optopt, 1) : longerr;
+	}
+
 private:
+	[[nodiscard]] int parse_long(std::string_view arg) noexcept;
+
 	const char* optarg = nullptr;
 	int optind = 1;
 	char optopt = 0;
 	const char* argit = nullptr;
+	std::string_view longerr{};
 
 	const int argc;
 	char* const * const argv;
 	const char* const optstring;
+	const long_option* const longopts;
+	const std::size_t num_longopts;
 };
 
 #endif
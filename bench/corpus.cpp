@@ -0,0 +1,187 @@
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../arg.h"
+#include "synth.h"
+
+/*
+ * Writes a corpus shaped like a texture pack into a directory:
+ *
+ *     pack.ls              includes every group script
+ *     groups/groupN.ls     includes the set scripts of the group
+ *     sets/setN.ls         one $dest, and a few atlases to grab from
+ *     atlas/sheetN.bmp     512x512 8-bit atlases, {sheetN.bmp if transparent
+ *     wads/                where the WAD files go
+ *
+ * Paths in the scripts are relative to the directory, which sclumpy is meant
+ * to be run from.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+constexpr std::uint32_t atlas_size = 512;
+constexpr std::size_t atlases_per_set = 4;
+constexpr std::size_t sets_per_group = 4;
+
+struct shape {
+	std::uint64_t seed = 0x5c1u;
+	std::size_t atlases = 48;
+	std::size_t grabs = 64; // per atlas
+};
+
+[[nodiscard]] std::size_t parse_count(std::string_view a)
+{
+	std::size_t n = 0;
+	const auto [end, ec] = std::from_chars(a.data(), a.data() + a.size(),
+	                                       n);
+	if (ec != std::errc{} || end != a.data() + a.size() || n == 0) {
+		std::ostringstream s;
+		s << "Invalid count: "sv << a;
+		throw std::invalid_argument(s.str());
+	}
+	return n;
+}
+
+[[nodiscard]] std::string numbered(std::string_view prefix, std::size_t i,
+                                   int width)
+{
+	std::ostringstream s;
+	s << prefix << std::setw(width) << std::setfill('0') << i;
+	return s.str();
+}
+
+void write_file(const std::filesystem::path& p, const void* data,
+                std::size_t size)
+{
+	std::ofstream out(p, std::ios::binary);
+	out.write(static_cast<const char*>(data),
+	          static_cast<std::streamsize>(size));
+	out.close();
+	if (!out) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not write " << p;
+		throw std::ofstream::failure(s.str());
+	}
+}
+
+void write_file(const std::filesystem::path& p, std::string_view text)
+{
+	write_file(p, text.data(), text.size());
+}
+
+// Atlases alternate palette sizes, and every fourth one is transparent
+[[nodiscard]] std::string write_atlas(const std::filesystem::path& dir,
+                                      std::size_t i, std::uint64_t seed)
+{
+	static constexpr std::uint32_t colors[] = {255, 64, 128, 32};
+	const bool transparent = i % 4 == 3;
+	const std::string name = numbered(transparent ? "atlas/{sheet"sv :
+	                                                "atlas/sheet"sv, i, 3)
+	                         + ".bmp";
+	const auto bmp = synth::make_bmp(atlas_size, atlas_size,
+	                                 colors[i % 4], transparent, seed + i);
+	write_file(dir / name, bmp.data(), bmp.size());
+	return name;
+}
+
+// Mostly 64x64 textures, with a few bigger and smaller ones
+void write_grabs(std::ostream& out, const shape& sh, std::size_t atlas,
+                 bool transparent, synth::generator& gen)
+{
+	for (std::size_t g = 0; g < sh.grabs; ++g) {
+		const std::uint32_t r = gen.below(16);
+		const std::uint32_t size = r == 0 ? 128 : r == 1 ? 32 : 64;
+		const std::uint32_t cells = (atlas_size - size) / 16 + 1;
+		const std::size_t index = atlas * sh.grabs + g;
+		out << (transparent ? "{t"sv : "t"sv) << index << " miptex "sv
+		    << gen.below(cells) * 16 << ' ' << gen.below(cells) * 16
+		    << ' ' << size << ' ' << size << '\n';
+	}
+}
+
+void write_corpus(const std::filesystem::path& dir, const shape& sh)
+{
+	for (const char* sub : {"atlas", "groups", "sets", "wads"})
+		std::filesystem::create_directories(dir / sub);
+	synth::generator gen(sh.seed);
+	std::ostringstream pack, group;
+	pack << "// Generated texture pack, seed "sv << sh.seed << '\n';
+	const std::size_t sets = (sh.atlases + atlases_per_set - 1)
+	                         / atlases_per_set;
+	for (std::size_t set = 0; set < sets; ++set) {
+		std::ostringstream text;
+		const std::string name = numbered("set"sv, set, 3);
+		text << "$dest \"wads/"sv << name << ".wad\"\n"sv;
+		for (std::size_t k = 0; k < atlases_per_set; ++k) {
+			const std::size_t a = set * atlases_per_set + k;
+			if (a >= sh.atlases)
+				break;
+			const std::string bmp = write_atlas(dir, a, sh.seed);
+			text << "\n$loadbmp \""sv << bmp << "\"\n"sv;
+			write_grabs(text, sh, a, a % 4 == 3, gen);
+		}
+		write_file(dir / "sets" / (name + ".ls"), text.str());
+		group << "$include \"sets/"sv << name << ".ls\"\n"sv;
+		if (set % sets_per_group == sets_per_group - 1
+		    || set + 1 == sets) {
+			const std::string g = numbered("group"sv,
+			                               set / sets_per_group, 2);
+			write_file(dir / "groups" / (g + ".ls"), group.str());
+			group.str({});
+			pack << "$include \"groups/"sv << g << ".ls\"\n"sv;
+		}
+	}
+	write_file(dir / "pack.ls", pack.str());
+	std::cout << sh.atlases << " atlases and "sv << sh.atlases * sh.grabs
+	          << " grabs written to "sv << dir << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		argument_parser arg(argc, argv, ":a:g:s:");
+		shape sh;
+		int c;
+		while ((c = arg()) >= 0) {
+			switch (c) {
+			case 'a':
+				sh.atlases = parse_count(arg.argument());
+				break;
+			case 'g':
+				sh.grabs = parse_count(arg.argument());
+				break;
+			case 's':
+				sh.seed = parse_count(arg.argument());
+				break;
+			default:
+				throw std::invalid_argument(
+					"Usage: corpus [-a atlases] [-g grabs] "
+					"[-s seed] directory");
+			}
+		}
+		if (argc - arg.operand() != 1)
+			throw std::invalid_argument("Expected one directory");
+		write_corpus(argv[argc - 1], sh);
+		return EXIT_SUCCESS;
+	} catch (const std::exception& e) {
+		std::cerr << "\nError:\n" << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+}
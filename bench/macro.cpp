@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <locale>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../arg.h"
+
+/*
+ * Times sclumpy end to end on a corpus written by bench/corpus, in WAD3 and
+ * in WAD2 (-8) mode. Each mode is run several times, and the medians of wall,
+ * user and system time and of peak resident set size are printed as one JSON
+ * object per line.
+ *
+ * With -b, the results are compared with those saved in a baseline file, and
+ * the runner fails if wall time or peak RSS grew by more than the threshold.
+ * A missing baseline is written instead, as it is with -u.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+struct result {
+	std::string mode{};
+	double wall = 0.;
+	double user = 0.;
+	double sys = 0.;
+	double rss = 0.; // KiB
+};
+
+struct options {
+	std::filesystem::path baseline{};
+	std::string jobs{};
+	std::size_t runs = 3;
+	double threshold = 10.; // percent
+	bool update = false;
+};
+
+[[nodiscard]] std::system_error
+system_error(const char* func, unsigned int line, std::string_view what)
+{
+	const int e = errno;
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": " << what;
+	return std::system_error(e, std::generic_category(), s.str());
+}
+
+[[nodiscard]] double seconds(const timeval& t) noexcept
+{
+	return static_cast<double>(t.tv_sec)
+	       + static_cast<double>(t.tv_usec) / 1e6;
+}
+
+// Runs sclumpy from the corpus directory, with its output thrown away
+[[nodiscard]] result run_once(const std::filesystem::path& exe,
+                              const std::filesystem::path& dir,
+                              std::vector<std::string> args)
+{
+	std::vector<char*> argv;
+	args.insert(args.begin(), exe.string());
+	for (std::string& a : args)
+		argv.push_back(a.data());
+	argv.push_back(nullptr);
+	const auto start = std::chrono::steady_clock::now();
+	const pid_t pid = ::fork();
+	if (pid < 0)
+		throw system_error(__func__, __LINE__, "Could not fork"sv);
+	if (pid == 0) {
+		const int null = ::open("/dev/null", O_WRONLY);
+		if (::chdir(dir.c_str()) < 0 || null < 0
+		    || ::dup2(null, STDOUT_FILENO) < 0)
+			::_exit(126);
+		::execv(argv[0], argv.data());
+		::_exit(127);
+	}
+	int status = 0;
+	rusage usage{};
+	while (::wait4(pid, &status, 0, &usage) < 0) {
+		if (errno != EINTR)
+			throw system_error(__func__, __LINE__,
+			                   "Could not wait for sclumpy"sv);
+	}
+	const auto t = std::chrono::steady_clock::now() - start;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": sclumpy failed with status " << status;
+		throw std::runtime_error(s.str());
+	}
+	return {{}, std::chrono::duration<double>(t).count(),
+	        seconds(usage.ru_utime), seconds(usage.ru_stime),
+	        static_cast<double>(usage.ru_maxrss)};
+}
+
+[[nodiscard]] double median(std::vector<double> v)
+{
+	const auto mid = v.begin() + v.size() / 2;
+	std::nth_element(v.begin(), mid, v.end());
+	return *mid;
+}
+
+[[nodiscard]] result run_mode(const std::filesystem::path& exe,
+                              const std::filesystem::path& dir,
+                              const options& opt, std::string_view mode,
+                              bool wad2)
+{
+	std::vector<std::string> args;
+	if (wad2)
+		args.push_back("-8");
+	if (!opt.jobs.empty())
+		args.push_back("-j" + opt.jobs);
+	args.push_back("pack.ls");
+	std::vector<double> wall, user, sys, rss;
+	for (std::size_t i = 0; i < opt.runs; ++i) {
+		const result r = run_once(exe, dir, args);
+		wall.push_back(r.wall);
+		user.push_back(r.user);
+		sys.push_back(r.sys);
+		rss.push_back(r.rss);
+	}
+	return {std::string(mode), median(wall), median(user), median(sys),
+	        median(rss)};
+}
+
+[[nodiscard]] std::string to_json(const result& r)
+{
+	std::ostringstream s;
+	s.imbue(std::locale::classic());
+	s << "{\"mode\":\""sv << r.mode << "\",\"wall_s\":"sv << r.wall
+	  << ",\"user_s\":"sv << r.user << ",\"sys_s\":"sv << r.sys
+	  << ",\"peak_rss_kib\":"sv << r.rss << '}';
+	return s.str();
+}
+
+// Value of a field in a line printed by to_json()
+[[nodiscard]] std::optional<std::string> field(std::string_view line,
+                                               std::string_view key)
+{
+	const std::string k = "\"" + std::string(key) + "\":";
+	const std::size_t at = line.find(k);
+	if (at == std::string_view::npos)
+		return std::nullopt;
+	std::string_view v = line.substr(at + k.size());
+	v = v.substr(0, v.find_first_of(",}"sv));
+	if (!v.empty() && v.front() == '"')
+		v = v.substr(1, v.size() - 2);
+	return std::string(v);
+}
+
+[[nodiscard]] std::vector<result>
+read_baseline(const std::filesystem::path& path)
+{
+	std::ifstream in(path);
+	std::vector<result> base;
+	std::string line;
+	while (std::getline(in, line)) {
+		const auto mode = field(line, "mode"sv);
+		const auto wall = field(line, "wall_s"sv);
+		const auto rss = field(line, "peak_rss_kib"sv);
+		if (!mode || !wall || !rss)
+			continue;
+		std::istringstream w(*wall), r(*rss);
+		w.imbue(std::locale::classic());
+		r.imbue(std::locale::classic());
+		result b;
+		b.mode = *mode;
+		w >> b.wall;
+		r >> b.rss;
+		base.push_back(b);
+	}
+	return base;
+}
+
+// Prints what grew past the threshold, and tells whether anything did
+[[nodiscard]] bool regressed(const std::vector<result>& results,
+                             const std::vector<result>& base,
+                             double threshold)
+{
+	const double limit = 1. + threshold / 100.;
+	bool any = false;
+	for (const result& r : results) {
+		const auto p = [&r](const result& b) {
+			return b.mode == r.mode;
+		};
+		const auto b = std::find_if(base.cbegin(), base.cend(), p);
+		if (b == base.cend())
+			continue;
+		const auto check = [&](std::string_view what, double now,
+		                       double then) {
+			if (then <= 0. || now <= then * limit)
+				return;
+			any = true;
+			std::cerr << r.mode << ": "sv << what << " went from "sv
+			          << then << " to "sv << now << " (+"sv
+			          << (now / then - 1.) * 100. << "%)"sv
+			          << std::endl;
+		};
+		check("wall time"sv, r.wall, b->wall);
+		check("peak RSS"sv, r.rss, b->rss);
+	}
+	return any;
+}
+
+void write_baseline(const std::filesystem::path& path,
+                    const std::vector<result>& results)
+{
+	std::ofstream out(path);
+	for (const result& r : results)
+		out << to_json(r) << '\n';
+	out.close();
+	if (!out) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not write baseline " << path;
+		throw std::ofstream::failure(s.str());
+	}
+}
+
+[[nodiscard]] std::size_t parse_runs(std::string_view a)
+{
+	std::size_t n = 0;
+	const auto [end, ec] = std::from_chars(a.data(), a.data() + a.size(),
+	                                       n);
+	if (ec != std::errc{} || end != a.data() + a.size() || n == 0) {
+		std::ostringstream s;
+		s << "Invalid number of runs: "sv << a;
+		throw std::invalid_argument(s.str());
+	}
+	return n;
+}
+
+[[nodiscard]] double parse_threshold(std::string_view a)
+{
+	std::istringstream s{std::string(a)};
+	s.imbue(std::locale::classic());
+	double t = 0.;
+	if (!(s >> t) || !s.eof() || t < 0.) {
+		std::ostringstream m;
+		m << "Invalid threshold: "sv << a;
+		throw std::invalid_argument(m.str());
+	}
+	return t;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		argument_parser arg(argc, argv, ":b:j:n:t:u");
+		options opt;
+		int c;
+		while ((c = arg()) >= 0) {
+			switch (c) {
+			case 'b':
+				opt.baseline = arg.argument();
+				break;
+			case 'j':
+				opt.jobs = arg.argument();
+				break;
+			case 'n':
+				opt.runs = parse_runs(arg.argument());
+				break;
+			case 't':
+				opt.threshold = parse_threshold(arg.argument());
+				break;
+			case 'u':
+				opt.update = true;
+				break;
+			default:
+				throw std::invalid_argument(
+					"Usage: macro [-u] [-b baseline] "
+					"[-j jobs] [-n runs] [-t percent] "
+					"sclumpy directory");
+			}
+		}
+		if (argc - arg.operand() != 2)
+			throw std::invalid_argument("Expected sclumpy and a "
+			                            "corpus directory");
+		const auto exe = std::filesystem::absolute(argv[argc - 2]);
+		const std::filesystem::path dir = argv[argc - 1];
+		std::cout.imbue(std::locale::classic());
+		std::vector<result> results;
+		results.push_back(run_mode(exe, dir, opt, "wad3"sv, false));
+		std::cout << to_json(results.back()) << std::endl;
+		results.push_back(run_mode(exe, dir, opt, "wad2"sv, true));
+		std::cout << to_json(results.back()) << std::endl;
+		if (opt.baseline.empty())
+			return EXIT_SUCCESS;
+		if (opt.update || !std::filesystem::exists(opt.baseline)) {
+			write_baseline(opt.baseline, results);
+			std::cout << "Baseline written to "sv << opt.baseline
+			          << std::endl;
+			return EXIT_SUCCESS;
+		}
+		if (regressed(results, read_baseline(opt.baseline),
+		              opt.threshold))
+			return EXIT_FAILURE;
+		std::cout << "No regression beyond "sv << opt.threshold
+		          << "% of "sv << opt.baseline << std::endl;
+		return EXIT_SUCCESS;
+	} catch (const std::exception& e) {
+		std::cerr << "\nError:\n" << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+}
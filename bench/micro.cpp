@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../arena.h"
+#include "../image.h"
+#include "../mipmap.h"
+#include "../pool.h"
+#include "../tokenizer.h"
+#include "../wad.h"
+#include "synth.h"
+
+/*
+ * Microbenchmarks of the hot kernels on synthetic inputs, which only depend
+ * on the seed. Each case is printed as one JSON object per line:
+ *
+ *     {"bench":"mipmap","case":"opaque-256x256-64","iterations":120,
+ *      "ns_per_op":...,"unit":"texel","ns_per_unit":...,"mb_per_s":...,
+ *      "allocs_per_op":...}
+ *
+ * Times are medians over the iterations of a case. Operands select the cases
+ * whose bench or case name contains one of them.
+ */
+
+using namespace std::literals;
+
+static std::atomic<std::uint64_t> allocations{0};
+
+void* operator new(std::size_t n)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* const p = std::malloc(n > 0 ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace {
+
+using synth::generator;
+
+constexpr std::uint64_t seed = 0x5c1u;
+constexpr auto min_time = 250ms;
+constexpr std::size_t min_iterations = 5;
+constexpr std::size_t max_iterations = 100000;
+
+// One timed operation
+struct sample {
+	double ns;
+	std::uint64_t allocs;
+};
+
+// Times the calls to f between start() and stop()
+class stopwatch {
+public:
+	void start() noexcept {
+		allocs = allocations.load(std::memory_order_relaxed);
+		begin = clock::now();
+	}
+
+	void stop() noexcept {
+		const auto t = clock::now() - begin;
+		s.ns = std::chrono::duration<double, std::nano>(t).count();
+		s.allocs = allocations.load(std::memory_order_relaxed)
+		           - allocs;
+	}
+
+	[[nodiscard]] sample result() const noexcept { return s; }
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	clock::time_point begin{};
+	std::uint64_t allocs = 0;
+	sample s{0., 0};
+};
+
+struct bench_case {
+	std::string_view bench;
+	std::string name;
+	std::string_view unit;
+	std::size_t units;   // per operation
+	std::size_t bytes;   // processed per operation
+	std::function<void(stopwatch&)> op;
+};
+
+/*
+ * Miptex lump as far as level 0, which is the image upside down with the
+ * transparent color moved to 255 as image::make_transparent() does, so that
+ * images bigger than miptex lumps allow can still be reduced.
+ */
+[[nodiscard]] std::vector<std::byte>
+level_zero(const std::vector<std::byte>& bmp, std::uint32_t w,
+           std::uint32_t h, std::uint32_t colors, bool transparent)
+{
+	const std::uint32_t row = (w + 3) / 4 * 4;
+	const auto first = bmp.cend() - std::ptrdiff_t{row} * h;
+	std::vector<std::byte> lump(40);
+	for (std::uint32_t y = h; y-- > 0;) {
+		const auto r = first + std::ptrdiff_t{row} * y;
+		lump.insert(lump.end(), r, r + w);
+	}
+	if (transparent)
+		std::replace(lump.begin() + 40, lump.end(),
+		             synth::low_byte(colors - 1), std::byte{255});
+	return lump;
+}
+
+[[nodiscard]] std::string image_case(std::uint32_t size,
+                                     std::uint32_t colors, bool transparent)
+{
+	std::ostringstream s;
+	s << (transparent ? "transparent-"sv : "opaque-"sv) << size << 'x'
+	  << size << '-' << colors;
+	return s.str();
+}
+
+// Decoding and mipmaps of the same image
+void add_image_case(std::vector<bench_case>& cases, bool transparent,
+                    std::uint32_t size, std::uint32_t colors, std::uint64_t s)
+{
+	const auto bmp = std::make_shared<const std::vector<std::byte>>(
+		synth::make_bmp(size, size, colors, transparent, s));
+	const std::string name = image_case(size, colors, transparent);
+	const std::size_t texels = std::size_t{size} * size;
+	cases.push_back({"read_bitmap_data"sv, name, "texel"sv, texels,
+	                 bmp->size(), [bmp, transparent](stopwatch& w) {
+		w.start();
+		const image img(bmp->data(), bmp->size(), transparent);
+		w.stop();
+	}});
+	const auto lump = std::make_shared<const std::vector<std::byte>>(
+		level_zero(*bmp, size, size, colors, transparent));
+	cases.push_back({"mipmap"sv, name, "texel"sv, texels, texels,
+	                 [bmp, lump, transparent](stopwatch& w) {
+		// Colors get added to the palette of the image
+		image img(bmp->data(), bmp->size(), transparent);
+		const auto [width, height] = img.dimensions();
+		w.start();
+		const scratch_arena::scope scope;
+		mipmap_generator gen(img, width, height, lump->data());
+		for (int lvl = 1; lvl < 4; ++lvl)
+			static_cast<void>(gen.generate(lvl));
+		w.stop();
+	}});
+}
+
+void add_image_cases(std::vector<bench_case>& cases)
+{
+	std::uint64_t s = seed;
+	for (const bool transparent : {false, true}) {
+		for (const std::uint32_t size : {64u, 128u, 256u, 512u}) {
+			for (const std::uint32_t colors : {16u, 64u, 255u})
+				add_image_case(cases, transparent, size,
+				               colors, ++s);
+		}
+	}
+}
+
+/*
+ * Lumpy script shaped like a texture pack: a $loadbmp every 16 directives,
+ * the others being miptex grabs, with the odd comment and quoted path.
+ */
+[[nodiscard]] std::string make_script(std::size_t directives,
+                                      std::uint64_t s)
+{
+	generator gen(s);
+	std::ostringstream text;
+	text << "// generated\n$dest \"out.wad\"\n"sv;
+	for (std::size_t i = 0; i < directives; ++i) {
+		if (i % 16 == 0) {
+			text << "$loadbmp \"atlas/sheet"sv << i / 16
+			     << ".bmp\"\n"sv;
+		} else {
+			text << "tex"sv << i << " miptex "sv
+			     << gen.below(8) * 64 << ' ' << gen.below(8) * 64
+			     << " 64 64"sv;
+			if (i % 7 == 0)
+				text << " ; from the old pack"sv;
+			text << '\n';
+		}
+	}
+	return text.str();
+}
+
+void add_tokenizer_cases(std::vector<bench_case>& cases)
+{
+	std::uint64_t s = seed;
+	for (const std::size_t n : {10u, 100u, 1000u, 10000u, 100000u}) {
+		const auto text = std::make_shared<const std::string>(
+			make_script(n, ++s));
+		const std::string name = std::to_string(n) + "-directives";
+		cases.push_back({"read_token"sv, name, "directive"sv, n,
+		                 text->size(),
+		                 [text](stopwatch& w) {
+			script_tokenizer t(*text);
+			w.start();
+			while (!t.read_token().empty())
+				;
+			w.stop();
+		}});
+	}
+}
+
+void add_wad_cases(std::vector<bench_case>& cases)
+{
+	const std::filesystem::path path =
+		std::filesystem::temp_directory_path() / "sclumpy-bench.wad";
+	std::uint64_t s = seed;
+	const std::pair<std::uint32_t, std::size_t> shapes[] = {
+		{64, 16}, {64, 256}, {64, 4096}, {256, 256}
+	};
+	for (const auto& [size, count] : shapes) {
+		generator gen(++s);
+		const std::size_t texels = std::size_t{size} * size;
+		auto lump = std::make_shared<std::vector<std::byte>>(
+			40 + texels * 85 / 64 + 2 + 768);
+		for (std::byte& b : *lump)
+			b = std::byte{static_cast<unsigned char>(gen())};
+		std::ostringstream name;
+		name << count << 'x' << size << 'x' << size;
+		cases.push_back({"wad_write"sv, name.str(), "lump"sv, count,
+		                 12 + count * (lump->size() + 32),
+		                 [lump, count, path](stopwatch& w) {
+			w.start();
+			wad::writer writer(path, true);
+			for (std::size_t i = 0; i < count; ++i) {
+				const std::string n = "tex" + std::to_string(i);
+				writer.add(n, lump->data(), lump->size(),
+				           wad::type_miptex);
+			}
+			writer.write();
+			w.stop();
+		}});
+	}
+}
+
+/*
+ * Many more threads than cores, on batches small enough for them to steal
+ * from each other all the time. Every index must run exactly once, and a
+ * lost range would leave for_each waiting forever.
+ */
+void add_pool_cases(std::vector<bench_case>& cases)
+{
+	const auto pool = std::make_shared<worker_pool>(16);
+	const std::pair<std::size_t, std::size_t> shapes[] = {
+		{16, 1}, {1024, 1}, {65536, 1}, {64, 16}, {64, 1024}
+	};
+	for (const auto& [outer, inner] : shapes) {
+		std::ostringstream name;
+		name << outer << 'x' << inner;
+		cases.push_back({"pool_for_each"sv, name.str(), "task"sv,
+		                 outer * inner, 0,
+		                 [pool, outer, inner](stopwatch& w) {
+			std::vector<unsigned char> runs(outer * inner);
+			const auto run = [&](std::size_t i) {
+				pool->for_each(inner, [&](std::size_t j) {
+					++runs[i * inner + j];
+				});
+			};
+			w.start();
+			pool->for_each(outer, run);
+			w.stop();
+			const auto once = [](unsigned char r) {
+				return r == 1;
+			};
+			if (!std::all_of(runs.cbegin(), runs.cend(), once))
+				throw std::logic_error("Task not run once");
+		}});
+	}
+}
+
+[[nodiscard]] bool selected(const bench_case& c,
+                            const std::vector<std::string_view>& filters)
+{
+	if (filters.empty())
+		return true;
+	const auto p = [&c](std::string_view f) {
+		return c.bench.find(f) != std::string_view::npos
+		       || c.name.find(f) != std::string::npos;
+	};
+	return std::any_of(filters.cbegin(), filters.cend(), p);
+}
+
+void run(const bench_case& c)
+{
+	std::vector<double> times;
+	std::uint64_t allocs = 0;
+	double total = 0.;
+	const double min_ns = std::chrono::duration<double, std::nano>(
+		min_time).count();
+	while (times.size() < max_iterations
+	       && (times.size() < min_iterations || total < min_ns)) {
+		stopwatch w;
+		c.op(w);
+		const sample s = w.result();
+		times.push_back(s.ns);
+		allocs += s.allocs;
+		total += s.ns;
+	}
+	const auto mid = times.begin() + times.size() / 2;
+	std::nth_element(times.begin(), mid, times.end());
+	const double ns = *mid;
+	const auto n = static_cast<double>(times.size());
+	std::cout << "{\"bench\":\""sv << c.bench << "\",\"case\":\""sv
+	          << c.name << "\",\"iterations\":"sv << times.size()
+	          << ",\"ns_per_op\":"sv << ns << ",\"unit\":\""sv << c.unit
+	          << "\",\"ns_per_unit\":"sv
+	          << ns / static_cast<double>(c.units)
+	          << ",\"mb_per_s\":"sv
+	          << static_cast<double>(c.bytes) * 1e3 / ns
+	          << ",\"allocs_per_op\":"sv
+	          << static_cast<double>(allocs) / n << '}' << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		std::cout.imbue(std::locale::classic());
+		const std::vector<std::string_view> filters(argv + 1,
+		                                            argv + argc);
+		std::vector<bench_case> cases;
+		add_image_cases(cases);
+		add_tokenizer_cases(cases);
+		add_wad_cases(cases);
+		add_pool_cases(cases);
+		for (const bench_case& c : cases) {
+			if (selected(c, filters))
+				run(c);
+		}
+		std::filesystem::remove(std::filesystem::temp_directory_path()
+		                        / "sclumpy-bench.wad");
+		return EXIT_SUCCESS;
+	} catch (const std::exception& e) {
+		std::cerr << "\nError:\n" << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+}
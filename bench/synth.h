@@ -0,0 +1,97 @@
+#ifndef BENCH_SYNTH_H
+#define BENCH_SYNTH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Synthetic inputs of the benchmarks, which only depend on their seed
+namespace synth {
+
+// xorshift64*, so that inputs are the same with every standard library
+class generator {
+public:
+	explicit generator(std::uint64_t s) noexcept : state{s * 2 + 1} {}
+
+	[[nodiscard]] std::uint32_t operator()() noexcept {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return static_cast<std::uint32_t>(
+			(state * 0x2545f4914f6cdd1dull) >> 32);
+	}
+
+	[[nodiscard]] std::uint32_t below(std::uint32_t n) noexcept {
+		return (*this)() % n;
+	}
+
+private:
+	std::uint64_t state;
+};
+
+[[nodiscard]] inline std::byte low_byte(std::uint32_t n) noexcept
+{
+	return std::byte{static_cast<unsigned char>(n & 0xff)};
+}
+
+inline void put_u16(std::vector<std::byte>& v, std::uint32_t n)
+{
+	v.push_back(low_byte(n));
+	v.push_back(low_byte(n >> 8));
+}
+
+inline void put_u32(std::vector<std::byte>& v, std::uint32_t n)
+{
+	put_u16(v, n & 0xffff);
+	put_u16(v, n >> 16);
+}
+
+/*
+ * 8-bit BMP file of smooth noise over the given number of colors, so that
+ * mipmaps average similar neighbours as in real textures. Transparent images
+ * get (0, 0, 255) as their last color, covering about an eighth of them.
+ */
+[[nodiscard]] inline std::vector<std::byte>
+make_bmp(std::uint32_t w, std::uint32_t h, std::uint32_t colors,
+         bool transparent, std::uint64_t s)
+{
+	generator gen(s);
+	const std::uint32_t row = (w + 3) / 4 * 4;
+	const std::uint32_t offset = 14 + 40 + 4 * colors;
+	std::vector<std::byte> bmp;
+	bmp.reserve(offset + std::size_t{row} * h);
+	bmp.push_back(std::byte{'B'});
+	bmp.push_back(std::byte{'M'});
+	put_u32(bmp, offset + row * h);
+	put_u32(bmp, 0);
+	put_u32(bmp, offset);
+	for (const std::uint32_t n : {40u, w, h})
+		put_u32(bmp, n);
+	put_u16(bmp, 1);
+	put_u16(bmp, 8);
+	for (const std::uint32_t n : {0u, row * h, 2835u, 2835u, colors, 0u})
+		put_u32(bmp, n);
+	for (std::uint32_t c = 0; c < colors; ++c) {
+		const bool key = transparent && c == colors - 1;
+		bmp.push_back(low_byte(key ? 255 : gen()));
+		bmp.push_back(low_byte(key ? 0 : gen()));
+		bmp.push_back(low_byte(key ? 0 : gen()));
+		bmp.push_back(std::byte{0});
+	}
+	for (std::uint32_t y = 0; y < h; ++y) {
+		for (std::uint32_t x = 0; x < row; ++x) {
+			std::uint32_t c = (x / 8 + y / 8 + gen.below(4))
+			                  % colors;
+			if (transparent && gen.below(8) == 0)
+				c = colors - 1;
+			else if (transparent && c == colors - 1)
+				c = 0;
+			bmp.push_back(low_byte(c));
+		}
+	}
+	return bmp;
+}
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <climits>
 #include <cstddef>
+#include <type_traits>
 
 template<class It, class N>
 It put_little_endian(It it, N n)
@@ -25,4 +26,15 @@ It put_big_endian(It it, N n)
 	return it;
 }
 
+template<class N>
+[[nodiscard]] N get_little_endian(const std::byte* p) noexcept
+{
+	using U = std::make_unsigned_t<N>;
+	U n = 0;
+	for (unsigned b = 0; b < sizeof (N); ++b)
+		n = static_cast<U>(n | std::to_integer<U>(p[b])
+		                       << (CHAR_BIT * b));
+	return static_cast<N>(n);
+}
+
 #endif
@@ -0,0 +1,232 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "byte.h"
+#include "check.h"
+#include "cmd.h"
+#include "trace.h"
+#include "wad.h"
+
+/*
+ * Lumps are held to the limits which check_miptex_size(), wad::writer::add()
+ * and warn_dimensions() enforce while building, and miptex lumps to the
+ * layout grab_miptex() writes: the four levels one after the other from the
+ * end of the header, then in WAD3 a palette of 256 colors.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+using entry = wad::reader::entry;
+
+struct findings {
+	std::vector<std::string> errors{};
+	std::vector<std::string> warnings{};
+};
+
+template <typename... T>
+[[nodiscard]] std::string concat(const T&... parts)
+{
+	std::ostringstream s;
+	(s << ... << parts);
+	return s.str();
+}
+
+[[nodiscard]] bool same_name(std::string_view a, std::string_view b)
+{
+	if (a.size() != b.size())
+		return false;
+	const std::locale& loc = std::locale::classic();
+	for (std::size_t i = 0; i < a.size(); ++i) {
+		if (std::tolower(a[i], loc) != std::tolower(b[i], loc))
+			return false;
+	}
+	return true;
+}
+
+// Tells whether grab_miptex() could have laid out levels of these dimensions
+bool check_dimensions(std::int32_t w, std::int32_t h, findings& f)
+{
+	bool valid = true;
+	const auto side = [&](std::string_view what, std::int32_t n) {
+		if (n <= 0 || n > wad::max_miptex_side) {
+			f.errors.push_back(concat(what, " ("sv, n,
+			                          ") is not between 1 and "sv,
+			                          wad::max_miptex_side));
+			valid = false;
+		} else if (n % 16 != 0) {
+			f.errors.push_back(concat(what, " ("sv, n, ") is not "
+			                          "a multiple of 16"sv));
+			valid = false;
+		}
+	};
+	side("width"sv, w);
+	side("height"sv, h);
+	if (valid && w * h > wad::max_miptex_area) {
+		f.errors.push_back(concat("size ("sv, w * h,
+		                          ") exceeds the maximum of "sv,
+		                          wad::max_miptex_area));
+	}
+	return valid;
+}
+
+void check_spray(std::int32_t w, std::int32_t h, findings& f)
+{
+	const std::int32_t surface = w * h;
+	if (const auto problem = wad::spray_problem(surface); !problem.empty())
+		f.warnings.push_back(concat(surface, " pixels, which is "sv,
+		                            problem));
+}
+
+void check_miptex(const std::byte* data, const entry& e, bool wad3,
+                  findings& f)
+{
+	if (e.size < wad::miptex_header_size) {
+		f.errors.push_back("shorter than a miptex header");
+		return;
+	}
+	const auto chars = reinterpret_cast<const char*>(data);
+	const std::string_view name(chars, ::strnlen(chars, 16));
+	if (name.size() == 16) {
+		f.errors.push_back("miptex name is not terminated");
+	} else if (!same_name(name, e.name)) {
+		f.warnings.push_back(concat("miptex name '"sv, name,
+		                            "' differs from the entry"sv));
+	}
+	const auto w = get_little_endian<std::int32_t>(data + 16);
+	const auto h = get_little_endian<std::int32_t>(data + 20);
+	if (!check_dimensions(w, h, f))
+		return;
+	if (wad3 && same_name(e.name, "{logo"sv))
+		check_spray(w, h, f);
+
+	std::size_t end = wad::miptex_header_size;
+	bool laid_out = true;
+	for (int lvl = 0; lvl < 4; ++lvl) {
+		const auto o = get_little_endian<std::uint32_t>(
+			data + 24 + 4 * lvl);
+		if (o != end) {
+			f.errors.push_back(concat("level "sv, lvl,
+			                          " at offset "sv, o,
+			                          " instead of "sv, end));
+			laid_out = false;
+		}
+		end += static_cast<std::size_t>(w >> lvl)
+		       * static_cast<std::size_t>(h >> lvl);
+	}
+	if (!laid_out)
+		return;
+	if (e.size < end) {
+		f.errors.push_back(concat(e.size, " bytes, but level 3 "
+		                          "ends at "sv, end));
+		return;
+	}
+	if (wad3) {
+		if (e.size - end < 2) {
+			f.errors.push_back("no palette");
+			return;
+		}
+		const auto colors = get_little_endian<std::uint16_t>(
+			data + end);
+		if (colors != 256) {
+			f.errors.push_back(concat("palette of "sv, colors,
+			                          " colors instead of 256"sv));
+		}
+		end += 2 + 3 * std::size_t{colors};
+		if (e.size < end) {
+			f.errors.push_back(concat(e.size, " bytes, but the "
+			                          "palette ends at "sv, end));
+			return;
+		}
+	}
+	// Lumps are padded to 4 bytes
+	if (e.size - end >= 4) {
+		f.warnings.push_back(concat(e.size - end,
+		                            " bytes past the end of the "sv,
+		                            wad3 ? "palette"sv : "levels"sv));
+	}
+}
+
+[[nodiscard]] findings check_lump(const wad::reader& wad, const entry& e)
+{
+	findings f;
+	if (e.name.size() > 15)
+		f.errors.push_back("name longer than 15 characters");
+	if (e.size > wad::lump::max_size) {
+		f.errors.push_back(concat(e.size, " bytes, more than "sv,
+		                          wad::lump::max_size));
+	}
+	if (!wad.in_bounds(e)) {
+		f.errors.push_back("out of bounds");
+		return f;
+	}
+	if (e.compressed) {
+		f.warnings.push_back("compressed, so not checked further");
+		return f;
+	}
+	if (e.type == wad::type_miptex)
+		check_miptex(wad.data(e), e, wad.wad3(), f);
+	return f;
+}
+
+void print(std::string_view name, const findings& f)
+{
+	std::cout << name << ':';
+	if (f.errors.empty() && f.warnings.empty())
+		std::cout << " ok"sv;
+	std::string_view separator = " "sv;
+	for (const std::string& s : f.errors) {
+		std::cout << separator << "error: "sv << s;
+		separator = "; "sv;
+	}
+	for (const std::string& s : f.warnings) {
+		std::cout << separator << "warning: "sv << s;
+		separator = "; "sv;
+	}
+	std::cout << '\n';
+}
+
+}
+
+void run_check(const std::filesystem::path& path)
+{
+	const wad::reader wad(path);
+	const std::vector<entry>& entries = wad.entries();
+	std::vector<findings> results(entries.size());
+	for_each_job(entries.size(), [&](std::size_t i) {
+		const trace::span span("check", entries[i].name);
+		results[i] = check_lump(wad, entries[i]);
+	});
+
+	std::size_t errors = 0, warnings = 0;
+	for (std::size_t i = 0; i < entries.size(); ++i) {
+		print(entries[i].name, results[i]);
+		errors += !results[i].errors.empty();
+		warnings += !results[i].warnings.empty();
+	}
+	const bool too_many = entries.size() > wad::max_lumps;
+	if (too_many) {
+		std::cout << wad.path() << ": error: "sv << entries.size()
+		          << " lumps, more than "sv << wad::max_lumps << '\n';
+	}
+	std::cout << entries.size() << " lumps checked, "sv << errors
+	          << " with errors, "sv << warnings << " with warnings"sv
+	          << std::endl;
+	if (errors > 0 || too_many) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": WAD file " << wad.path()
+		  << " breaks the limits of the engine";
+		throw std::runtime_error(s.str());
+	}
+}
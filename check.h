@@ -0,0 +1,9 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <filesystem>
+
+// Prints what each lump of a WAD file breaks of the limits of the engine
+void run_check(const std::filesystem::path& wad);
+
+#endif
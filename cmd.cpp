@@ -1,12 +1,21 @@
 #include <cstdlib>
 #include <filesystem>
+#include <functional>
+#include <memory>
 
 #include "cmd.h"
+#include "pool.h"
 
 using std::filesystem::path;
 
 static path working_directory;
 static bool wad2;
+static bool cascade;
+static bool atlas;
+static bool dedup;
+static std::size_t shard_bytes;
+static std::size_t shard_lumps;
+static std::unique_ptr<worker_pool> pool;
 
 static path get_path_from_environment(const char* const var)
 {
@@ -35,3 +44,79 @@ bool check_wad3() noexcept
 {
 	return !wad2;
 }
+
+void plan_cascade() noexcept
+{
+	cascade = true;
+}
+
+bool check_cascade() noexcept
+{
+	return cascade;
+}
+
+void plan_atlas() noexcept
+{
+	atlas = true;
+}
+
+bool check_atlas() noexcept
+{
+	return atlas;
+}
+
+void plan_dedup() noexcept
+{
+	dedup = true;
+}
+
+bool check_dedup() noexcept
+{
+	return dedup;
+}
+
+void plan_shard_bytes(const std::size_t bytes) noexcept
+{
+	shard_bytes = bytes;
+}
+
+void plan_shard_lumps(const std::size_t lumps) noexcept
+{
+	shard_lumps = lumps;
+}
+
+bool check_shards() noexcept
+{
+	return shard_bytes > 0 || shard_lumps > 0;
+}
+
+std::size_t check_shard_bytes() noexcept
+{
+	return shard_bytes;
+}
+
+std::size_t check_shard_lumps() noexcept
+{
+	return shard_lumps;
+}
+
+void plan_jobs(const unsigned int jobs)
+{
+	pool = std::make_unique<worker_pool>(jobs);
+}
+
+worker_pool* job_pool() noexcept
+{
+	return pool.get();
+}
+
+void for_each_job(const std::size_t n,
+                  const std::function<void(std::size_t)>& f)
+{
+	if (pool) {
+		pool->for_each(n, f);
+	} else {
+		for (std::size_t i = 0; i < n; ++i)
+			f(i);
+	}
+}
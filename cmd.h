@@ -1,11 +1,31 @@
 #ifndef CMD_H
 #define CMD_H
 
+#include <cstddef>
 #include <filesystem>
+#include <functional>
+
+class worker_pool;
 
 void set_working_directory(std::filesystem::path project);
 [[nodiscard]] std::filesystem::path expand(const std::filesystem::path& p);
 void plan_wad2() noexcept;
 [[nodiscard]] bool check_wad3() noexcept;
+void plan_cascade() noexcept;
+[[nodiscard]] bool check_cascade() noexcept;
+void plan_atlas() noexcept;
+[[nodiscard]] bool check_atlas() noexcept;
+void plan_dedup() noexcept;
+[[nodiscard]] bool check_dedup() noexcept;
+void plan_shard_bytes(std::size_t bytes) noexcept;
+void plan_shard_lumps(std::size_t lumps) noexcept;
+[[nodiscard]] bool check_shards() noexcept;
+[[nodiscard]] std::size_t check_shard_bytes() noexcept;
+[[nodiscard]] std::size_t check_shard_lumps() noexcept;
+void plan_jobs(unsigned int jobs);
+[[nodiscard]] worker_pool* job_pool() noexcept;
+
+// Calls f(i) for each i in [0, n), on the pool of -j if there is one
+void for_each_job(std::size_t n, const std::function<void(std::size_t)>& f);
 
 #endif
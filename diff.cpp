@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "cmd.h"
+#include "diff.h"
+#include "stringutils.h"
+#include "trace.h"
+#include "wad.h"
+
+/*
+ * Lumps are matched by name regardless of case, as the engine looks them up,
+ * the nth lump of a name in one file with the nth lump of that name in the
+ * other. A match whose name changed case is reported as renamed. Payloads are hashed first, and only those
+ * with equal hashes are compared byte by byte. Changed miptex lumps of equal
+ * dimensions are then compared level by level.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+using entry = wad::reader::entry;
+
+[[nodiscard]] std::vector<std::size_t> hash_lumps(const wad::reader& wad)
+{
+	const std::vector<entry>& entries = wad.entries();
+	std::vector<std::size_t> hashes(entries.size());
+	for_each_job(entries.size(), [&](std::size_t i) {
+		if (!wad.in_bounds(entries[i]))
+			return;
+		const trace::span span("hash", entries[i].name);
+		hashes[i] = wad::hash_bytes(wad.data(entries[i]),
+		                            entries[i].size);
+	});
+	return hashes;
+}
+
+// Index in the other file of the lump matching each lump, if any
+[[nodiscard]] std::vector<std::optional<std::size_t>>
+match(const std::vector<entry>& from, const std::vector<entry>& to)
+{
+	std::unordered_map<std::string, std::vector<std::size_t>> by_name;
+	for (std::size_t i = to.size(); i-- > 0;)
+		by_name[util::lowercase(to[i].name)].push_back(i);
+	std::vector<std::optional<std::size_t>> matches(from.size());
+	for (std::size_t i = 0; i < from.size(); ++i) {
+		const auto it = by_name.find(util::lowercase(from[i].name));
+		if (it == by_name.end() || it->second.empty())
+			continue;
+		matches[i] = it->second.back();
+		it->second.pop_back();
+	}
+	return matches;
+}
+
+[[nodiscard]] std::string
+describe_miptex(const wad::miptex_view& a, const wad::miptex_view& b)
+{
+	std::ostringstream s;
+	if (a.width() != b.width() || a.height() != b.height()) {
+		s << a.width() << 'x' << a.height() << " -> "sv << b.width()
+		  << 'x' << b.height();
+		return s.str();
+	}
+	s << std::fixed << std::setprecision(1);
+	const char* separator = "";
+	for (int lvl = 0; lvl < 4; ++lvl) {
+		const std::size_t n = a.level_size(lvl);
+		const std::byte* const pa = a.level(lvl);
+		const std::byte* const pb = b.level(lvl);
+		std::size_t differ = 0;
+		for (std::size_t i = 0; i < n; ++i)
+			differ += pa[i] != pb[i];
+		if (differ == 0)
+			continue;
+		s << separator << "level "sv << lvl << ": "sv
+		  << 100. * static_cast<double>(differ) / static_cast<double>(n)
+		  << "% of texels"sv;
+		separator = ", ";
+	}
+	const std::size_t ca = 3 * a.colors(), cb = 3 * b.colors();
+	if (ca != cb || !std::equal(a.palette(), a.palette() + ca,
+	                            b.palette()))
+		s << separator << "palette"sv;
+	return s.str();
+}
+
+/*
+ * What changed from one lump to the other, given that they differ. Lumps
+ * whose data lies past the end of their file are reported as such, so that a
+ * few bad entries do not stop the comparison of the others.
+ */
+[[nodiscard]] std::string describe(const wad::reader& a, const entry& ea,
+                                   const wad::reader& b, const entry& eb)
+{
+	const bool ba = !a.in_bounds(ea), bb = !b.in_bounds(eb);
+	if (ba || bb) {
+		return ba && bb ? "out of bounds in both files"s :
+		       ba ? "out of bounds in the first file"s :
+		       "out of bounds in the second file"s;
+	}
+	std::ostringstream s;
+	if (ea.type != eb.type || ea.compressed || eb.compressed
+	    || ea.type != wad::type_miptex) {
+		s << ea.size << " -> "sv << eb.size << " bytes"sv;
+		return s.str();
+	}
+	try {
+		const wad::miptex_view ma(a.data(ea), ea.size, a.wad3());
+		const wad::miptex_view mb(b.data(eb), eb.size, b.wad3());
+		const std::string levels = describe_miptex(ma, mb);
+		if (!levels.empty())
+			return levels;
+	} catch (const std::invalid_argument&) {
+		// Broken miptex lumps are only compared as bytes
+	}
+	s << ea.size << " -> "sv << eb.size << " bytes"sv;
+	return s.str();
+}
+
+}
+
+void run_diff(const std::filesystem::path& from,
+              const std::filesystem::path& to)
+{
+	const wad::reader a(from), b(to);
+	const std::vector<entry>& ea = a.entries();
+	const std::vector<entry>& eb = b.entries();
+	const auto ha = hash_lumps(a);
+	const auto hb = hash_lumps(b);
+	const auto matches = match(ea, eb);
+
+	std::vector<std::string> changes(ea.size()); // empty if unchanged
+	for_each_job(ea.size(), [&](std::size_t i) {
+		if (!matches[i])
+			return;
+		const std::size_t j = *matches[i];
+		if (ea[i].name != eb[j].name)
+			changes[i] = "renamed to "s + eb[j].name;
+		if (a.in_bounds(ea[i]) && b.in_bounds(eb[j])
+		    && ha[i] == hb[j] && ea[i].size == eb[j].size
+		    && ea[i].type == eb[j].type
+		    && std::memcmp(a.data(ea[i]), b.data(eb[j]),
+		                   ea[i].size) == 0)
+			return;
+		const trace::span span("diff", ea[i].name);
+		if (!changes[i].empty())
+			changes[i] += ", "sv;
+		changes[i] += describe(a, ea[i], b, eb[j]);
+	});
+
+	std::vector<bool> matched(eb.size());
+	std::size_t removed = 0, changed = 0;
+	for (std::size_t i = 0; i < ea.size(); ++i) {
+		if (!matches[i]) {
+			std::cout << "- "sv << ea[i].name << std::endl;
+			++removed;
+			continue;
+		}
+		matched[*matches[i]] = true;
+		if (changes[i].empty())
+			continue;
+		std::cout << "~ "sv << ea[i].name << ": "sv << changes[i]
+		          << std::endl;
+		++changed;
+	}
+	std::size_t added = 0;
+	for (std::size_t j = 0; j < eb.size(); ++j) {
+		if (matched[j])
+			continue;
+		std::cout << "+ "sv << eb[j].name << std::endl;
+		++added;
+	}
+	std::cout << added << " lumps added, "sv << removed << " removed, "sv
+	          << changed << " changed, "sv
+	          << ea.size() - removed - changed << " unchanged"sv
+	          << std::endl;
+}
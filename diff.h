@@ -0,0 +1,10 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <filesystem>
+
+// Prints which lumps were added, removed or changed from one WAD to another
+void run_diff(const std::filesystem::path& from,
+              const std::filesystem::path& to);
+
+#endif
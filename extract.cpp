@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "byte.h"
+#include "cmd.h"
+#include "extract.h"
+#include "stats.h"
+#include "stringutils.h"
+#include "trace.h"
+#include "wad.h"
+
+/*
+ * Each miptex lump becomes a BMP file named after its directory entry, with
+ * the base level as pixels and the lump palette as colors, which the BMP
+ * loader reads back as it was. Names starting with { thus stay transparent.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+constexpr std::uint32_t bmp_offset = 14 + 40 + 4 * 256;
+
+// Output buffer of each thread, kept from one lump to the next
+thread_local std::vector<std::byte> buffer;
+
+// Lump names may hold path separators, which file names cannot
+[[nodiscard]] std::string file_stem(std::string_view name)
+{
+	std::string f(name);
+	for (char& c : f) {
+		const auto u = static_cast<unsigned char>(c);
+		if (c == '/' || c == '\\' || u < 0x20)
+			c = '_';
+	}
+	if (f.empty() || f == "." || f == "..")
+		f.insert(0, "_");
+	return f;
+}
+
+/*
+ * Names that only differ by case or by what file_stem() replaced would have
+ * their files written over each other, so the later ones get a ~N suffix.
+ * Case is ignored as WAD3 names and some file systems do.
+ */
+[[nodiscard]] std::vector<std::string>
+file_names(const std::vector<const wad::reader::entry*>& lumps)
+{
+	std::vector<std::string> names;
+	names.reserve(lumps.size());
+	std::set<std::string> taken;
+	for (const wad::reader::entry* e : lumps) {
+		const std::string stem = file_stem(e->name);
+		std::string f = stem;
+		for (unsigned int n = 2; !taken.insert(util::lowercase(f)).second; ++n)
+			f = stem + '~' + std::to_string(n);
+		names.push_back(f + ".bmp");
+	}
+	return names;
+}
+
+void encode_bmp(std::vector<std::byte>& out, const wad::miptex_view& m)
+{
+	const auto width = static_cast<std::uint32_t>(m.width());
+	const auto height = static_cast<std::uint32_t>(m.height());
+	const std::uint32_t stride = (width + 3) & ~3u;
+	const std::uint32_t size = bmp_offset + stride * height;
+	out.resize(size);
+	std::byte* it = out.data();
+	*it++ = std::byte{'B'};
+	*it++ = std::byte{'M'};
+	it = put_little_endian(it, size);
+	it = put_little_endian(it, std::uint32_t{0});
+	it = put_little_endian(it, bmp_offset);
+	it = put_little_endian(it, std::uint32_t{40});
+	it = put_little_endian(it, m.width());
+	it = put_little_endian(it, m.height());
+	it = put_little_endian(it, std::uint16_t{1});
+	it = put_little_endian(it, std::uint16_t{8});
+	it = put_little_endian(it, std::uint32_t{0});
+	it = put_little_endian(it, stride * height);
+	it = put_little_endian(it, std::int32_t{0});
+	it = put_little_endian(it, std::int32_t{0});
+	it = put_little_endian(it, std::uint32_t{256});
+	it = put_little_endian(it, std::uint32_t{0});
+	const std::byte* const palette = m.palette();
+	for (std::size_t c = 0; c < 256; ++c, it += 4) {
+		const bool set = c < m.colors();
+		it[0] = set ? palette[3 * c + 2] : std::byte{0};
+		it[1] = set ? palette[3 * c + 1] : std::byte{0};
+		it[2] = set ? palette[3 * c] : std::byte{0};
+		it[3] = std::byte{0};
+	}
+	for (std::uint32_t y = 0; y < height; ++y, it += stride) {
+		const std::byte* const row = m.level(0)
+		                             + (height - 1 - y) * width;
+		std::fill(std::copy(row, row + width, it), it + stride,
+		          std::byte{0});
+	}
+}
+
+void write_file(const std::filesystem::path& path,
+                const std::vector<std::byte>& bytes)
+{
+	const stats::timer timer(stats::phase::write);
+	std::ofstream file(path, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(bytes.data()),
+	           static_cast<std::streamsize>(bytes.size()));
+	file.close();
+	if (!file) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not write " << path;
+		throw std::ofstream::failure(s.str());
+	}
+	stats::add(stats::counter::bytes_written, bytes.size());
+}
+
+}
+
+void run_extract(const std::filesystem::path& path,
+                 const std::filesystem::path& dir)
+{
+	const wad::reader wad(path);
+	if (!wad.wad3()) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__ << ": "
+		  << wad.path() << " is a WAD2 file, whose lumps have no "
+		  << "palette to write";
+		throw std::invalid_argument(s.str());
+	}
+	std::vector<const wad::reader::entry*> lumps;
+	for (const wad::reader::entry& e : wad.entries()) {
+		if (e.type == wad::type_miptex && !e.compressed)
+			lumps.push_back(&e);
+	}
+	const auto names = file_names(lumps);
+	std::filesystem::create_directories(dir);
+	for_each_job(lumps.size(), [&](std::size_t i) {
+		const wad::reader::entry& e = *lumps[i];
+		const trace::span span("extract", e.name);
+		try {
+			const wad::miptex_view m(wad.data(e), e.size, true);
+			encode_bmp(buffer, m);
+			write_file(dir / names[i], buffer);
+		} catch (const std::exception& ex) {
+			std::ostringstream s;
+			s << __FILE__ ":" << __func__ << ':' << __LINE__
+			  << ": Could not extract lump '" << e.name << "'\n"
+			  << ex.what();
+			throw std::runtime_error(s.str());
+		}
+	});
+	std::cout << lumps.size() << " miptex lumps extracted from "sv
+	          << wad.path() << " into "sv << dir << std::endl;
+	if (const auto skipped = wad.entries().size() - lumps.size())
+		std::cout << skipped << " other lumps skipped"sv << std::endl;
+}
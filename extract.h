@@ -0,0 +1,10 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <filesystem>
+
+// Writes the miptex lumps of a WAD3 file into a directory as 8-bit BMP files
+void run_extract(const std::filesystem::path& wad,
+                 const std::filesystem::path& dir);
+
+#endif
@@ -1,32 +1,121 @@
 #include <algorithm>
 #include <array>
+#include <cerrno>
 #include <climits>
-#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
+#include <system_error>
 #include <string_view>
 #include <tuple>
 #include <utility>
 #include <variant>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "arena.h"
 #include "bmp.h"
 #include "byte.h"
 #include "cmd.h"
 #include "image.h"
+#include "mipmap.h"
+#include "stats.h"
+#include "trace.h"
+#include "wad.h"
+
+namespace {
+
+// BMP file of an atlas, shared by its clones
+class atlas_file {
+public:
+	atlas_file(const std::filesystem::path& path, std::uint64_t offset,
+	           std::uint64_t stride);
+	atlas_file(const atlas_file&) = delete;
+	atlas_file& operator=(const atlas_file&) = delete;
+	~atlas_file() noexcept { ::close(fd); }
+
+	// Reads part of a row, counted from the bottom as in the file
+	void read(std::byte* out, std::size_t size, std::uint64_t row,
+	          std::uint64_t column) const;
+
+private:
+	const int fd;
+	const std::uint64_t offset; // of the pixels
+	const std::uint64_t stride; // padded row size
+};
+
+atlas_file::atlas_file(const std::filesystem::path& path,
+                       const std::uint64_t o, const std::uint64_t s)
+	: fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)}
+	, offset{o}
+	, stride{s}
+{
+	if (fd < 0) {
+		const int e = errno;
+		std::ostringstream m;
+		m << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not open bitmap file: " << path;
+		throw std::system_error(e, std::generic_category(), m.str());
+	}
+}
+
+void atlas_file::read(std::byte* out, std::size_t size,
+                      const std::uint64_t row,
+                      const std::uint64_t column) const
+{
+	auto at = static_cast<off_t>(offset + row * stride + column);
+	while (size > 0) {
+		const ssize_t r = ::pread(fd, out, size, at);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			const int e = errno;
+			std::ostringstream s;
+			s << __FILE__ ":" << __func__ << ':' << __LINE__
+			  << ": Could not read row " << row << " of atlas";
+			throw std::system_error(e, std::generic_category(),
+			                        s.str());
+		}
+		if (r == 0) {
+			std::ostringstream s;
+			s << __FILE__ ":" << __func__ << ':' << __LINE__
+			  << ": Atlas ends before row " << row;
+			throw std::istream::failure(s.str());
+		}
+		out += r;
+		size -= static_cast<std::size_t>(r);
+		at += r;
+	}
+}
+
+}
+
+struct image::lazy_pixels {
+	std::shared_ptr<const atlas_file> file;
+	std::array<std::byte, 256> table; // permutations since loading
+	std::vector<std::array<std::int32_t, 4>> cleared{}; // x, y, w, h
+};
+
+void image::lazy_deleter::operator()(lazy_pixels* const p) const noexcept
+{
+	delete p;
+}
 
 image::image(image&& other) noexcept
 	: data{std::exchange(other.data, nullptr)}
 	, width{other.width}
 	, height{other.height}
 	, transparent{other.transparent}
+	, lazy{std::move(other.lazy)}
 {
 	std::copy(std::begin(other.palette), std::end(other.palette),
 	          std::begin(palette));
@@ -42,9 +131,60 @@ image& image::operator=(image&& other) noexcept
 	width = other.width;
 	height = other.height;
 	transparent = other.transparent;
+	lazy = std::move(other.lazy);
 	return *this;
 }
 
+image::~image() noexcept
+{
+	if (data)
+		delete[] data;
+}
+
+image image::clone() const
+{
+	image copy;
+	std::copy(std::begin(palette), std::end(palette),
+	          std::begin(copy.palette));
+	if (data) {
+		const auto size = static_cast<std::size_t>(width * height);
+		auto buf = std::make_unique<std::byte[]>(size);
+		std::copy(data, data + size, buf.get());
+		copy.data = buf.release();
+	}
+	if (lazy)
+		copy.lazy.reset(new lazy_pixels(*lazy));
+	copy.width = width;
+	copy.height = height;
+	copy.transparent = transparent;
+	return copy;
+}
+
+image image::region(std::int32_t x, std::int32_t y, std::int32_t w,
+                    std::int32_t h) const
+{
+	if (x < 0 || y < 0 || w < 0 || h < 0)
+		return clone();
+	if (x + w > width || y + h > height) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Area " << w << 'x' << h << '+' << x << '+' << y
+		  << " exceeds image dimensions " << width << 'x' << height;
+		throw std::out_of_range(s.str());
+	}
+	image copy;
+	std::copy(std::begin(palette), std::end(palette),
+	          std::begin(copy.palette));
+	const auto size = static_cast<std::size_t>(w * h);
+	auto buf = std::make_unique<std::byte[]>(size);
+	fetch(x, y, w, h, buf.get());
+	copy.data = buf.release();
+	copy.width = w;
+	copy.height = h;
+	copy.transparent = transparent;
+	return copy;
+}
+
 image::image(const std::filesystem::path& path, image::load_type mode)
 	: image()
 {
@@ -56,11 +196,19 @@ image::image(const std::filesystem::path& path, image::load_type mode)
 		break;
 	case image::load_type::lbm:
 		load_lbm(path);
+		break;
+	case image::load_type::atlas:
+		load_atlas(path);
 	}
 }
 
 void image::permute(const std::byte table[256]) noexcept
 {
+	if (lazy) {
+		for (std::byte& b : lazy->table)
+			b = table[std::to_integer<unsigned char>(b)];
+		return;
+	}
 	if (!data)
 		return;
 	auto tr = [table](std::byte& b) {
@@ -78,7 +226,7 @@ read_palette_data(std::istream& file, const unsigned int num_colors)
 		  << ": Number of colors (" << num_colors << ") too large";
 		throw std::range_error(s.str());
 	}
-	std::array<std::byte, 768> palette;
+	std::array<std::byte, 768> palette{};
 	for (unsigned int c = 0; c < num_colors; ++c) {
 		std::byte* const b = &palette[3 * c];
 		if (!file.read(reinterpret_cast<char*>(b), 3)) {
@@ -110,7 +258,28 @@ read_bitmap_data(std::istream& file, const bmp::file_header& fh,
 		  << std::numeric_limits<std::uint32_t>::max();
 		throw std::range_error(s.str());
 	}
+	// Nothing is allocated for bytes the header claims but the file lacks
+	const std::streamoff start = pos;
+	file.seekg(0, std::ios_base::end);
+	const std::streamoff end = file.tellg();
+	file.seekg(pos);
+	if (fh.size() < start || fh.size() > end) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Bitmap file size (" << fh.size()
+		  << ") does not match its " << end << " bytes";
+		throw std::range_error(s.str());
+	}
 	const std::uint32_t dsz = fh.size() - static_cast<std::uint32_t>(pos);
+
+	// Rows are padded to 4 bytes in the file but not in memory
+	const std::uint32_t width_ru = ih.width() + (4 - ih.width() % 4) % 4;
+	if (std::uint64_t{width_ru} * ih.height() > dsz) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Bitmap data is too short for its dimensions";
+		throw std::range_error(s.str());
+	}
 	auto buf = std::make_unique<std::byte[]>(dsz);
 	if (!file.read(reinterpret_cast<char*>(buf.get()), dsz)) {
 		std::ostringstream s;
@@ -118,18 +287,62 @@ read_bitmap_data(std::istream& file, const bmp::file_header& fh,
 		  << ": Could not read bitmap data";
 		throw std::istream::failure(s.str());
 	}
-
-	auto inv_buf = std::make_unique<std::byte[]>(dsz);
-	const std::uint32_t width_ru = ih.width() + (4 - ih.width() % 4) % 4;
+	auto inv_buf = std::make_unique<std::byte[]>(
+		static_cast<std::size_t>(ih.width()) * ih.height());
 	for (std::int32_t y = 0; y < ih.height(); ++y) {
-		std::copy(&buf[(ih.height() - y - 1) * width_ru],
-		          &buf[(ih.height() - y) * width_ru],
-		          &inv_buf[y * width_ru]);
+		const auto row = &buf[(ih.height() - y - 1) * width_ru];
+		std::copy(row, row + ih.width(), &inv_buf[y * ih.width()]);
 	}
 
 	return inv_buf;
 }
 
+namespace {
+
+// Read-only stream buffer over bytes owned by someone else
+class memory_buffer : public std::streambuf {
+public:
+	memory_buffer(const std::byte* data, std::size_t size) {
+		char* const p = const_cast<char*>(
+			reinterpret_cast<const char*>(data));
+		setg(p, p, p + size);
+	}
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+	                 std::ios_base::openmode which) override {
+		if (!(which & std::ios_base::in))
+			return pos_type(off_type(-1));
+		char* base = eback();
+		if (dir == std::ios_base::cur)
+			base = gptr();
+		else if (dir == std::ios_base::end)
+			base = egptr();
+		if (off < eback() - base || off > egptr() - base)
+			return pos_type(off_type(-1));
+		setg(eback(), base + off, egptr());
+		return pos_type(gptr() - eback());
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+		override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+};
+
+}
+
+image::image(const std::byte* buf, std::size_t size, bool transp)
+	: image()
+{
+	memory_buffer mb(buf, size);
+	std::istream file(&mb);
+	load_bmp(file);
+	if (transp)
+		make_transparent();
+}
+
 void image::load_bmp(const std::filesystem::path& path)
 {
 	const std::filesystem::path exp = expand(path);
@@ -140,16 +353,28 @@ void image::load_bmp(const std::filesystem::path& path)
 		  << ": Could not open bitmap file: " << exp;
 		throw std::ifstream::failure(s.str());
 	}
+	load_bmp(file);
+	file.close();
+	if (path.stem().c_str()[0] == '{')
+		make_transparent();
+}
+
+void image::load_bmp(std::istream& file)
+{
+	const trace::span span("decode bmp");
+	const stats::timer timer(stats::phase::load);
 	const bmp::file_header fh(file);
+	stats::add(stats::counter::bytes_read, fh.size());
 	const bmp::info_header ih(file);
 	{
 		const auto pal = read_palette_data(file, ih.colors());
 		std::copy(pal.cbegin(), pal.cend(), std::begin(palette));
 	}
 	data = read_bitmap_data(file, fh, ih).release();
-	file.close();
 	width = ih.width();
 	height = ih.height();
+	stats::raise(stats::peak::image, static_cast<std::uint64_t>(width)
+	                                 * static_cast<std::uint64_t>(height));
 	if (width > std::numeric_limits<std::int16_t>::max()) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
@@ -165,10 +390,99 @@ void image::load_bmp(const std::filesystem::path& path)
 		  << std::numeric_limits<std::int16_t>::max();
 		throw std::range_error(s.str());
 	}
+}
+
+/*
+ * Only the headers and the palette are read here. Pixels stay in the file,
+ * which is why atlases may be bigger than other images.
+ */
+void image::load_atlas(const std::filesystem::path& path)
+{
+	const std::filesystem::path exp = expand(path);
+	std::ifstream file(exp, std::ios::binary);
+	if (!file) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not open bitmap file: " << exp;
+		throw std::ifstream::failure(s.str());
+	}
+	const stats::timer timer(stats::phase::load);
+	const bmp::file_header fh(file);
+	const bmp::info_header ih(file);
+	{
+		const auto pal = read_palette_data(file, ih.colors());
+		std::copy(pal.cbegin(), pal.cend(), std::begin(palette));
+	}
+	const auto pos = static_cast<std::uint64_t>(file.tellg());
+	file.close();
+	const auto stride = (static_cast<std::uint64_t>(ih.width()) + 3)
+	                    & ~std::uint64_t{3};
+	if (pos > fh.size() || stride * ih.height() > fh.size() - pos) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Bitmap data is too short for its dimensions";
+		throw std::range_error(s.str());
+	}
+	stats::add(stats::counter::bytes_read, pos);
+	lazy.reset(new lazy_pixels{
+		std::make_shared<const atlas_file>(exp, pos, stride), {}});
+	for (unsigned int c = 0; c < 256; ++c)
+		lazy->table[c] = std::byte{static_cast<unsigned char>(c)};
+	width = ih.width();
+	height = ih.height();
 	if (path.stem().c_str()[0] == '{')
 		make_transparent();
 }
 
+void image::fetch(const std::int32_t x, const std::int32_t y,
+                  const std::int32_t w, const std::int32_t h,
+                  std::byte* const out) const
+{
+	const auto columns = static_cast<std::size_t>(w);
+	if (!lazy) {
+		for (std::int32_t j = 0; j < h; ++j) {
+			const std::byte* const row = data + (y + j) * width + x;
+			std::copy(row, row + w, out + j * columns);
+		}
+		return;
+	}
+	for (std::int32_t j = 0; j < h; ++j) {
+		const auto row = static_cast<std::uint64_t>(height - 1 - y - j);
+		lazy->file->read(out + j * columns, columns, row,
+		                 static_cast<std::uint64_t>(x));
+	}
+	const std::size_t size = columns * static_cast<std::size_t>(h);
+	stats::add(stats::counter::bytes_read, size);
+	const auto& table = lazy->table;
+	std::transform(out, out + size, out, [&table](std::byte b) {
+		return table[std::to_integer<unsigned char>(b)];
+	});
+	for (const auto& [cx, cy, cw, ch] : lazy->cleared) {
+		const std::int32_t left = std::max(x, cx);
+		const std::int32_t right = std::min(x + w, cx + cw);
+		const std::int32_t top = std::max(y, cy);
+		const std::int32_t bottom = std::min(y + h, cy + ch);
+		for (std::int32_t j = top; j < bottom && left < right; ++j) {
+			std::byte* const row = out + (j - y) * columns;
+			std::fill(row + (left - x), row + (right - x),
+			          std::byte{0x00});
+		}
+	}
+}
+
+void image::clear(const std::int32_t x, const std::int32_t y,
+                  const std::int32_t w, const std::int32_t h)
+{
+	if (lazy) {
+		lazy->cleared.push_back({x, y, w, h});
+		return;
+	}
+	for (std::int32_t j = y; j < y + h; ++j) {
+		const std::int32_t left = j * width + x;
+		std::fill(&data[left], &data[left + w], std::byte{0x00});
+	}
+}
+
 void image::load_lbm([[maybe_unused]] const std::filesystem::path& path)
 {
 	throw std::logic_error("LBM loading not implemented");
@@ -214,211 +528,6 @@ void image::make_transparent() noexcept
 	          std::end(palette) - 3);
 }
 
-namespace {
-
-class mipmap_generator {
-public:
-	mipmap_generator(image& i, std::int32_t w, std::int32_t h,
-	                 const std::vector<std::byte>& l) noexcept;
-
-	[[nodiscard]] std::vector<std::byte> generate(int lvl);
-
-private:
-	void count_color(std::int32_t x, std::int32_t y);
-
-	[[nodiscard]] constexpr std::tuple<float, float, float>
-	get_average_color() const noexcept;
-
-	unsigned char average_pixels();
-	unsigned char add_color(float red, float green, float blue);
-	int find_unused_color() const noexcept;
-
-	unsigned char
-	reduce_pixel(std::int32_t x, std::int32_t y, std::int32_t step,
-	             unsigned int test);
-
-	image& img;
-	const std::vector<std::byte>& lump;
-	const std::int32_t width;
-	const std::int32_t height;
-
-	std::array<float, 768> linear_palette{};
-	float max_distortion = 0.f;
-	unsigned int colors_used = 0;
-	std::array<bool, 256> color_used{};
-
-	float distortion_red = 0.f;
-	float distortion_green = 0.f;
-	float distortion_blue = 0.f;
-	std::array<unsigned char, 256> pixel_mask{};
-	std::uint_fast8_t pixel_count = 0;
-};
-
-void mipmap_generator::count_color(std::int32_t x, std::int32_t y)
-{
-	const auto offset = 40 + y * width + x;
-	const auto c = std::to_integer<unsigned char>(lump[offset]);
-	if (!color_used[c]) {
-		color_used[c] = true;
-		++colors_used;
-	}
-}
-
-mipmap_generator::mipmap_generator(image& i, std::int32_t w, std::int32_t h,
-                                   const std::vector<std::byte>& l)
-	noexcept
-	: img{i}
-	, lump{l}
-	, width{w}
-	, height{h}
-{
-	// Linearize the palette
-	{
-		auto adjust_gamma = [this](unsigned char val) {
-			const float f = static_cast<float>(val) / 255.f;
-			return std::pow(f, 2.2f);
-		};
-		img.transform_palette(linear_palette.begin(), adjust_gamma);
-	}
-
-	if (img.is_transparent()) {
-		// Assume the palette is full
-		colors_used = 255;
-		std::fill(color_used.begin(), color_used.end(), true);
-	} else {
-		std::fill(color_used.begin(), color_used.end(), false);
-		for (std::int32_t y = 0; y < height; ++y) {
-			for (std::int32_t x = 0; x < width; ++x)
-				count_color(x, y);
-		}
-	}
-}
-
-int mipmap_generator::find_unused_color() const noexcept
-{
-	const auto begin = color_used.cbegin();
-	const auto end = color_used.cend();
-	return static_cast<int>(std::find(begin, end, false) - begin);
-}
-
-unsigned char mipmap_generator::add_color(float red, float green, float blue)
-{
-	static const auto trans = [](float x) {
-		if (x < 0.f)
-			x = 0.f;
-		if (x > 1.f)
-			x = 1.f;
-		const float y = std::pow(x, 1.f / 2.2f) * 255.f;
-		return static_cast<unsigned char>(y);
-	};
-	const int c = find_unused_color();
-	linear_palette[3 * c] = red;
-	linear_palette[3 * c + 1] = green;
-	linear_palette[3 * c + 2] = blue;
-	img.set_color(c, trans(red), trans(green), trans(blue));
-	color_used[c] = true;
-	++colors_used;
-	return static_cast<unsigned char>(c);
-}
-
-[[nodiscard]] constexpr float hypotsqr(float x, float y, float z) noexcept
-{
-	return x * x + y * y + z * z;
-}
-
-constexpr std::tuple<float, float, float>
-mipmap_generator::get_average_color() const noexcept
-{
-	float red = 0.f;
-	float green = 0.f;
-	float blue = 0.f;
-	for (unsigned int i = 0; i < pixel_count; ++i) {
-		const unsigned int c = pixel_mask[i];
-		red += linear_palette[3 * c];
-		green += linear_palette[3 * c + 1];
-		blue += linear_palette[3 * c + 2];
-	}
-	const float n = pixel_count;
-	return {red / n + distortion_red,
-	        green / n + distortion_green,
-	        blue / n + distortion_blue};
-}
-
-unsigned char mipmap_generator::average_pixels()
-{
-	const auto [red, green, blue] = get_average_color();
-
-	float best_distortion = 3.f;
-	int best_color = -1;
-	const auto extract_value = [this](int c, int s) {
-		return linear_palette[3 * c + s];
-	};
-	for (int c = 0; c < 255; ++c) {
-		if (!color_used[c])
-			continue;
-		const float dist_red = red - extract_value(c, 0);
-		const float dist_green = green - extract_value(c, 1);
-		const float dist_blue = blue - extract_value(c, 2);
-		const float dist = hypotsqr(dist_red, dist_green, dist_blue);
-		if (dist < best_distortion) {
-			if (dist == 0) {
-				distortion_red = 0.f;
-				distortion_green = 0.f;
-				distortion_blue = 0.f;
-				return static_cast<unsigned char>(c);
-			}
-			best_distortion = dist;
-			best_color = c;
-		}
-	}
-	if (best_distortion > 0.001f && colors_used < 255) {
-		best_color = add_color(red, green, blue);
-		distortion_red = distortion_green = distortion_blue = 0.f;
-		best_distortion = 0.f;
-	} else {
-		distortion_red = red - extract_value(best_color, 0);
-		distortion_green = green - extract_value(best_color, 1);
-		distortion_blue = blue - extract_value(best_color, 2);
-	}
-	return static_cast<unsigned char>(best_color);
-}
-
-unsigned char
-mipmap_generator::reduce_pixel(std::int32_t x, std::int32_t y,
-                               std::int32_t step, unsigned int test)
-{
-	pixel_count = 0;
-	for (std::int32_t j = 0; j < step; ++j) {
-		for (std::int32_t i = 0; i < step; ++i) {
-			const std::byte b = lump[40 + (y + j) * width + x + i];
-			const auto p = std::to_integer<unsigned char>(b);
-			if (!img.is_transparent() || p != 255) {
-				pixel_mask.at(pixel_count) = p;
-				++pixel_count;
-			}
-		}
-	}
-	return pixel_count <= test ? 0xff : average_pixels();
-}
-
-std::vector<std::byte> mipmap_generator::generate(const int lvl)
-{
-	distortion_red = distortion_green = distortion_blue = 0.f;
-	std::int32_t step = std::int32_t{1} << lvl;
-	const unsigned int test = (step * step * 2) / 5; // 40%
-	std::vector<std::byte> mipmap;
-	mipmap.reserve((height / lvl) * (width / lvl));
-	for (std::int32_t y = 0; y < height; y += step) {
-		for (std::int32_t x = 0; x < width; x += step) {
-			using std::byte;
-			mipmap.push_back(byte{reduce_pixel(x, y, step, test)});
-		}
-	}
-	return mipmap;
-}
-
-}
-
 image::lump_type
 image::grab_palette(std::string_view,
                     const std::vector<std::variant<std::int32_t, float>>&)
@@ -476,23 +585,23 @@ static void check_miptex_size(std::int32_t w, std::int32_t h)
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
 		  << ": Image height (" << h << ") is not a multiple of 16";
 		throw std::invalid_argument(s.str());
-	} else if (w > 1 << 15) {
+	} else if (w > wad::max_miptex_side) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
 		  << ": Image width (" << w << ") exceeds the maximum of"
-		  << (1 << 15);
+		  << wad::max_miptex_side;
 		throw std::invalid_argument(s.str());
-	} else if (h > 1 << 15) {
+	} else if (h > wad::max_miptex_side) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
 		  << ": Image height (" << h << ") exceeds the maximum of"
-		  << (1 << 15);
+		  << wad::max_miptex_side;
 		throw std::invalid_argument(s.str());
-	} else if (w * h > (0x50000 - 810) / 2) {
+	} else if (w * h > wad::max_miptex_area) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
 		  << ": Image size (" << (w * h) << ") exceeds the maximum of"
-		  << ((0x50000 - 810) / 2);
+		  << wad::max_miptex_area;
 		throw std::invalid_argument(s.str());
 	}
 }
@@ -524,13 +633,46 @@ image::lump_type
 image::grab_miptex(std::string_view name,
                    const std::vector<std::variant<std::int32_t, float>>& args)
 {
-	auto [x, y, w, h] = get_miptex_arguments(args);
+	const auto [x, y, w, h] = get_miptex_arguments(args);
+	return grab_miptex(name, x, y, w, h,
+	                   {check_wad3(), check_cascade(), job_pool()});
+}
+
+image::lump_type
+image::grab_miptex(std::string_view name, std::int32_t x, std::int32_t y,
+                   std::int32_t w, std::int32_t h, const miptex_options& opt)
+{
 	if (x < 0 || y < 0 || w < 0 || h < 0) {
 		x = y = 0;
 		w = width;
 		h = height;
 	}
 	check_miptex_size(w, h);
+	lump_type lump(miptex_size(w, h, opt.wad3));
+	const std::size_t size = grab_miptex(name, x, y, w, h, opt,
+	                                     lump.data(), lump.size());
+	lump.resize(size);
+	return lump;
+}
+
+std::size_t
+image::grab_miptex(std::string_view name, std::int32_t x, std::int32_t y,
+                   std::int32_t w, std::int32_t h, const miptex_options& opt,
+                   std::byte* out, std::size_t capacity)
+{
+	if (x < 0 || y < 0 || w < 0 || h < 0) {
+		x = y = 0;
+		w = width;
+		h = height;
+	}
+	check_miptex_size(w, h);
+	if (x + w > width || y + h > height) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Area " << w << 'x' << h << '+' << x << '+' << y
+		  << " exceeds image dimensions " << width << 'x' << height;
+		throw std::out_of_range(s.str());
+	}
 	if (name.size() >= 16) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
@@ -538,33 +680,53 @@ image::grab_miptex(std::string_view name,
 		  << ", maximum allowed is 15";
 		throw std::invalid_argument(s.str());
 	}
-	std::vector<std::byte> lump;
-	lump.reserve(810 + 2 * w * h);
-	auto it = std::back_inserter(lump);
-	it = put_lump_name(it, name);
+	if (const std::size_t size = miptex_size(w, h, opt.wad3);
+	    size > capacity) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Lump '" << name << "' needs " << size
+		  << " bytes, buffer only has " << capacity;
+		throw std::length_error(s.str());
+	}
+	std::byte* it = put_lump_name(out, name);
 	const std::int32_t vals[]{w, h, 40, 0, 0, 0};
 	for (const std::int32_t n : vals)
-		put_little_endian(it, n);
+		it = put_little_endian(it, n);
 
 	// Transfer image lines
-	for (std::int32_t j = y; j < y + h; ++j) {
-		const std::int32_t left = j * width + x;
-		std::copy(&data[left], &data[left + w], it);
-		std::fill(&data[left], &data[left + w], std::byte{0x00});
-	}
-
-	mipmap_generator generator(*this, w, h, lump);
-	for (int lvl = 1; lvl < 4; ++lvl) {
-		put_little_endian(lump.begin() + 24 + 4 * lvl,
-		                  static_cast<std::int32_t>(lump.size()));
-		const auto mipmap = generator.generate(lvl);
-		std::copy(mipmap.cbegin(), mipmap.cend(), it);
+	fetch(x, y, w, h, it);
+	clear(x, y, w, h);
+	it += static_cast<std::size_t>(w) * static_cast<std::size_t>(h);
+
+	const stats::timer timer(stats::phase::mipmap);
+	const scratch_arena::scope scope;
+	mipmap_generator generator(*this, w, h, out);
+	if (opt.cascade)
+		generator.cascade();
+	// Bands could not add colors in the same order as a serial scan
+	if (opt.pool && generator.palette_full()) {
+		const auto mipmaps = generator.generate_banded(*opt.pool);
+		for (int lvl = 1; lvl < 4; ++lvl) {
+			put_little_endian(out + 24 + 4 * lvl,
+			                  static_cast<std::int32_t>(it - out));
+			const auto& mipmap = mipmaps[lvl - 1];
+			it = std::copy(mipmap.cbegin(), mipmap.cend(), it);
+		}
+	} else {
+		for (int lvl = 1; lvl < 4; ++lvl) {
+			put_little_endian(out + 24 + 4 * lvl,
+			                  static_cast<std::int32_t>(it - out));
+			const auto mipmap = generator.generate(lvl);
+			it = std::copy(mipmap.cbegin(), mipmap.cend(), it);
+		}
 	}
-	if (check_wad3()) {
-		put_little_endian(it, std::uint16_t{256});
-		std::copy(std::cbegin(palette), std::cend(palette), it);
+	if (opt.wad3) {
+		it = put_little_endian(it, std::uint16_t{256});
+		it = std::copy(std::cbegin(palette), std::cend(palette), it);
 	}
-	return lump;
+	const auto size = static_cast<std::size_t>(it - out);
+	stats::raise(stats::peak::lump, size);
+	return size;
 }
 
 image::lump_type
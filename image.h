@@ -4,16 +4,28 @@
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <istream>
+#include <memory>
 #include <string_view>
 #include <utility>
 #include <variant>
 #include <vector>
 
+class worker_pool;
+
 class image {
 public:
 	using argument_type = std::variant<std::int32_t, float>;
 	using lump_type = std::vector<std::byte>;
-	enum class load_type { bmp, lbm };
+	// An atlas is a BMP file whose pixels are only read as they are grabbed
+	enum class load_type { bmp, lbm, atlas };
+
+	// How miptex lumps are built, independently of the command line
+	struct miptex_options {
+		bool wad3 = true;
+		bool cascade = false;
+		worker_pool* pool = nullptr;
+	};
 
 	constexpr image() noexcept
 		: data{nullptr}
@@ -27,13 +39,20 @@ public:
 	image(image&& other) noexcept;
 	image& operator=(image&& other) noexcept;
 
-	~image() noexcept {
-		if (data)
-			delete[] data;
-	}
+	~image() noexcept;
 
 	image(const std::filesystem::path& path, load_type mode);
 
+	// Decodes a BMP file held in memory
+	image(const std::byte* buf, std::size_t size, bool transp);
+
+	// Copy for grabbing, since grabs change the pixels and palette
+	[[nodiscard]] image clone() const;
+
+	// Copy of an area, or of the whole image if any argument is negative
+	[[nodiscard]] image region(std::int32_t x, std::int32_t y,
+	                           std::int32_t w, std::int32_t h) const;
+
 	[[nodiscard]] constexpr std::pair<int32_t, int32_t>
 	dimensions() const noexcept { return {width, height}; }
 
@@ -56,6 +75,9 @@ public:
 			*output++ = op(to_integer<unsigned char>(palette[i]));
 	}
 
+	// Filters the image to new dimensions, keeping its palette
+	void resample(std::int32_t w, std::int32_t h);
+
 	lump_type
 	grab_palette(std::string_view name,
 	             const std::vector<argument_type>& arg);
@@ -72,6 +94,28 @@ public:
 	grab_miptex(std::string_view name,
 	            const std::vector<argument_type>& arg);
 
+	lump_type
+	grab_miptex(std::string_view name, std::int32_t x, std::int32_t y,
+	            std::int32_t w, std::int32_t h, const miptex_options& opt);
+
+	/*
+	 * Same as above, writing the lump into out and returning its size.
+	 * Nothing is grabbed if capacity is less than miptex_size(w, h).
+	 */
+	std::size_t
+	grab_miptex(std::string_view name, std::int32_t x, std::int32_t y,
+	            std::int32_t w, std::int32_t h, const miptex_options& opt,
+	            std::byte* out, std::size_t capacity);
+
+	// Size of a miptex lump of w by h pixels
+	[[nodiscard]] static constexpr std::size_t
+	miptex_size(std::int32_t w, std::int32_t h, bool wad3) noexcept
+	{
+		const auto n = static_cast<std::size_t>(w)
+		               * static_cast<std::size_t>(h);
+		return 40 + n + n / 4 + n / 16 + n / 64 + (wad3 ? 2 + 768 : 0);
+	}
+
 	lump_type
 	grab_raw(std::string_view name,
 	         const std::vector<argument_type>& arg);
@@ -86,15 +130,31 @@ public:
 
 private:
 	void load_bmp(const std::filesystem::path& path);
+	void load_bmp(std::istream& file);
 	void load_lbm(const std::filesystem::path& path);
+	void load_atlas(const std::filesystem::path& path);
 	void make_transparent() noexcept; // may become public
 	void permute(const std::byte table[256]) noexcept;
 
+	// Pixels of an area, row by row, wherever they are
+	void fetch(std::int32_t x, std::int32_t y, std::int32_t w,
+	           std::int32_t h, std::byte* out) const;
+
+	// Blanks an area, as grabbing does
+	void clear(std::int32_t x, std::int32_t y, std::int32_t w,
+	           std::int32_t h);
+
+	struct lazy_pixels;
+	struct lazy_deleter {
+		void operator()(lazy_pixels* p) const noexcept;
+	};
+
 	std::byte palette[768]{};
 	std::byte* data;
 	int32_t width;
 	int32_t height;
 	bool transparent;
+	std::unique_ptr<lazy_pixels, lazy_deleter> lazy{}; // for atlases
 };
 
 #endif
@@ -0,0 +1,25 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+
+// Writes s quoted, with quotes, backslashes and control characters escaped
+inline void write_json_string(std::ostream& out, std::string_view s)
+{
+	out << '"';
+	for (const char c : s) {
+		const auto u = static_cast<unsigned char>(c);
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (u < 0x20)
+			out << "\\u" << std::hex << std::setw(4)
+			    << std::setfill('0') << unsigned{u} << std::dec;
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+#endif
@@ -0,0 +1,28 @@
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "image.h"
+#include "libsclumpy.h"
+#include "wad.h"
+
+image sclumpy::decode_bmp(const std::byte* data, std::size_t size,
+                          bool transparent)
+{
+	return image(data, size, transparent);
+}
+
+std::size_t sclumpy::grab_miptex(image& img, std::string_view name,
+                                 std::int32_t x, std::int32_t y,
+                                 std::int32_t w, std::int32_t h,
+                                 const image::miptex_options& opt,
+                                 std::byte* out, std::size_t capacity)
+{
+	return img.grab_miptex(name, x, y, w, h, opt, out, capacity);
+}
+
+void sclumpy::add_miptex(wad::writer& wad, std::string_view name,
+                         const std::byte* lump, std::size_t size)
+{
+	wad.add(name, lump, size, wad::type_miptex);
+}
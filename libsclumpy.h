@@ -0,0 +1,42 @@
+#ifndef LIBSCLUMPY_H
+#define LIBSCLUMPY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "image.h"
+#include "wad.h"
+
+/*
+ * In-memory entry points for embedding sclumpy. None of them depend on the
+ * command line or any other process-wide setting, so threads may call them
+ * concurrently as long as they do not share an image or a WAD writer.
+ */
+namespace sclumpy {
+
+// Size of a miptex lump of w by h pixels
+[[nodiscard]] constexpr std::size_t
+miptex_size(std::int32_t w, std::int32_t h, bool wad3 = true) noexcept
+{
+	return image::miptex_size(w, h, wad3);
+}
+
+// Decodes an 8-bit BMP file; transparent works like a name starting with {
+[[nodiscard]] image
+decode_bmp(const std::byte* data, std::size_t size, bool transparent);
+
+// Writes a miptex lump into out and returns its size
+std::size_t
+grab_miptex(image& img, std::string_view name, std::int32_t x, std::int32_t y,
+            std::int32_t w, std::int32_t h,
+            const image::miptex_options& opt, std::byte* out,
+            std::size_t capacity);
+
+// Adds a lump made by grab_miptex to a WAD file assembled in memory
+void add_miptex(wad::writer& wad, std::string_view name, const std::byte* lump,
+                std::size_t size);
+
+}
+
+#endif
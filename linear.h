@@ -0,0 +1,102 @@
+#ifndef LINEAR_H
+#define LINEAR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Fixed-point linear light, where palette bytes follow a 2.2 gamma curve.
+ * The tables are computed at compile time so that color matching only ever
+ * uses integer arithmetic and gives the same result everywhere.
+ */
+namespace linear {
+
+using value_type = std::int32_t;
+
+inline constexpr value_type one = 65535;
+inline constexpr std::size_t encoding_bits = 12;
+
+namespace detail {
+
+// Solves y^n = a for a in [0, 1] with Newton's method, starting from above
+[[nodiscard]] constexpr double root(const double a, const int n) noexcept
+{
+	if (a <= 0.)
+		return 0.;
+	double y = 1.;
+	for (int i = 0; i < 256; ++i) {
+		double p = 1.;
+		for (int k = 1; k < n; ++k)
+			p *= y;
+		const double next = ((n - 1) * y + a / p) / n;
+		if (next >= y)
+			break;
+		y = next;
+	}
+	return y;
+}
+
+// x^2.2 = x^2 * x^(1/5)
+[[nodiscard]] constexpr double decode(const double x) noexcept
+{
+	return x * x * root(x, 5);
+}
+
+// x^(1/2.2) = (x^5)^(1/11)
+[[nodiscard]] constexpr double encode(const double x) noexcept
+{
+	return root(x * x * x * x * x, 11);
+}
+
+[[nodiscard]] constexpr std::array<std::uint16_t, 256> make_decoding()
+	noexcept
+{
+	std::array<std::uint16_t, 256> t{};
+	for (std::size_t i = 0; i < t.size(); ++i) {
+		const double y = decode(static_cast<double>(i) / 255.) * one;
+		t[i] = static_cast<std::uint16_t>(y + .5);
+	}
+	return t;
+}
+
+[[nodiscard]] constexpr std::array<unsigned char, 1 << encoding_bits>
+make_encoding() noexcept
+{
+	std::array<unsigned char, 1 << encoding_bits> t{};
+	const double last = static_cast<double>(t.size() - 1);
+	for (std::size_t i = 0; i < t.size(); ++i) {
+		const double y = encode(static_cast<double>(i) / last) * 255.;
+		t[i] = static_cast<unsigned char>(y);
+	}
+	return t;
+}
+
+}
+
+// Linear value of each palette byte
+inline constexpr std::array<std::uint16_t, 256> decoding =
+	detail::make_decoding();
+
+// Palette byte of each linear value reduced to 12 bits, rounded down
+inline constexpr std::array<unsigned char, 1 << encoding_bits> encoding =
+	detail::make_encoding();
+
+[[nodiscard]] constexpr value_type decode(const unsigned char c) noexcept
+{
+	return decoding[c];
+}
+
+[[nodiscard]] constexpr unsigned char encode(value_type v) noexcept
+{
+	if (v < 0)
+		v = 0;
+	if (v > one)
+		v = one;
+	constexpr value_type last = (1 << encoding_bits) - 1;
+	return encoding[static_cast<std::size_t>((v * last + one / 2) / one)];
+}
+
+}
+
+#endif
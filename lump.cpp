@@ -8,6 +8,7 @@
 #include <utility>
 
 #include "cmd.h"
+#include "stats.h"
 #include "wad.h"
 
 wad::lump::lump(std::string_view n, const std::byte* dat, std::size_t sz)
@@ -59,4 +60,5 @@ void wad::lump::write(const std::filesystem::path& path) const
 	file.close();
 	if (!file)
 		throw write_failure(name(), expanded);
+	stats::add(stats::counter::bytes_written, size);
 }
@@ -0,0 +1,218 @@
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "cmd.h"
+#include "image.h"
+#include "manifest.h"
+#include "stats.h"
+#include "trace.h"
+#include "wad.h"
+
+/*
+ * A manifest has one miptex lump per line, as comma-separated fields:
+ *
+ *     source,x,y,width,height,name,wad
+ *
+ * Blank lines and lines starting with # are skipped, and fields are trimmed
+ * of surrounding blanks. As in Lumpy scripts, a negative region stands for
+ * the whole image.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+struct entry {
+	std::size_t source;
+	std::int32_t x, y, width, height;
+	std::string name;
+	std::size_t wad;
+};
+
+struct manifest {
+	std::vector<std::filesystem::path> sources{};
+	std::vector<std::filesystem::path> wads{};
+	std::vector<entry> entries{};
+};
+
+[[nodiscard]] std::invalid_argument
+manifest_error(const std::filesystem::path& path, std::size_t line,
+               std::string_view msg)
+{
+	std::ostringstream s;
+	s << "Error in manifest "sv << path << " on line "sv << line << ": "sv
+	  << msg;
+	return std::invalid_argument(s.str());
+}
+
+[[nodiscard]] std::string_view trim(std::string_view s) noexcept
+{
+	const auto first = s.find_first_not_of(" \t\r"sv);
+	if (first == std::string_view::npos)
+		return {};
+	return s.substr(first, s.find_last_not_of(" \t\r"sv) - first + 1);
+}
+
+using path_index = std::unordered_map<std::string, std::size_t>;
+
+// Index of the path, which is added if it is new
+[[nodiscard]] std::size_t intern(std::vector<std::filesystem::path>& paths,
+                                 path_index& index, std::string_view p)
+{
+	const auto [it, added] = index.try_emplace(std::string(p),
+	                                           paths.size());
+	if (added)
+		paths.emplace_back(p);
+	return it->second;
+}
+
+[[nodiscard]] manifest read_manifest(const std::filesystem::path& path)
+{
+	std::ifstream file(path);
+	if (!file) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Could not open manifest " << path;
+		throw std::ifstream::failure(s.str());
+	}
+	manifest m;
+	path_index sources, wads;
+	std::string line;
+	for (std::size_t n = 1; std::getline(file, line); ++n) {
+		const std::string_view l = trim(line);
+		if (l.empty() || l.front() == '#')
+			continue;
+		std::array<std::string_view, 7> fields;
+		std::size_t count = 0, start = 0;
+		for (;;) {
+			const std::size_t comma = l.find(',', start);
+			const auto f = l.substr(start, comma - start);
+			if (count < fields.size())
+				fields[count] = trim(f);
+			++count;
+			if (comma == std::string_view::npos)
+				break;
+			start = comma + 1;
+		}
+		if (count != fields.size())
+			throw manifest_error(path, n, "Expected 7 fields"sv);
+		std::array<std::int32_t, 4> region{};
+		for (std::size_t i = 0; i < region.size(); ++i) {
+			const std::string_view f = fields[i + 1];
+			const auto [end, ec] = std::from_chars(
+				f.data(), f.data() + f.size(), region[i]);
+			if (ec != std::errc{} || end != f.data() + f.size())
+				throw manifest_error(path, n, "Bad region"sv);
+		}
+		if (fields[0].empty() || fields[5].empty() || fields[6].empty())
+			throw manifest_error(path, n, "Empty field"sv);
+		m.entries.push_back({
+			intern(m.sources, sources, fields[0]),
+			region[0], region[1], region[2], region[3],
+			std::string(fields[5]),
+			intern(m.wads, wads, fields[6])
+		});
+	}
+	return m;
+}
+
+}
+
+/*
+ * Each image is decoded once, then every entry of it grabs from its own copy
+ * of the area it names, so that entries depend on nothing but their image and
+ * can all run at once. An image is dropped once its entries are grabbed, so
+ * only those being worked on are held. Lumps are added to their WAD files in
+ * manifest order.
+ */
+void run_manifest(const std::filesystem::path& path)
+{
+	const manifest m = read_manifest(path);
+	std::vector<std::vector<std::size_t>> by_source(m.sources.size());
+	for (std::size_t i = 0; i < m.entries.size(); ++i)
+		by_source[m.entries[i].source].push_back(i);
+
+	const image::miptex_options opt{check_wad3(), check_cascade(),
+	                                job_pool()};
+	std::vector<image::lump_type> lumps(m.entries.size());
+	const auto grab = [&](const image& img, std::size_t i) {
+		const entry& e = m.entries[i];
+		try {
+			const trace::span span("grab", e.name);
+			const stats::timer timer(stats::phase::grab);
+			image part = img.region(e.x, e.y, e.width, e.height);
+			lumps[i] = part.grab_miptex(e.name, 0, 0, -1, -1, opt);
+			stats::add_lump(e.name, timer.elapsed(),
+			                lumps[i].size());
+		} catch (const std::exception& ex) {
+			std::ostringstream s;
+			s << __FILE__ ":" << __func__ << ':' << __LINE__
+			  << ": Could not create lump '" << e.name << "'\n"
+			  << ex.what();
+			throw std::runtime_error(s.str());
+		}
+	};
+	for_each_job(m.sources.size(), [&](std::size_t s) {
+		image img;
+		{
+			const trace::span span("load", m.sources[s].native());
+			const auto mode = check_atlas() ?
+			                  image::load_type::atlas :
+			                  image::load_type::bmp;
+			img = image(m.sources[s], mode);
+		}
+		const std::vector<std::size_t>& group = by_source[s];
+		for_each_job(group.size(), [&](std::size_t j) {
+			grab(img, group[j]);
+		});
+	});
+
+	std::vector<wad::writer> writers;
+	writers.reserve(m.wads.size());
+	for (const std::filesystem::path& p : m.wads) {
+		wad::writer& w = writers.emplace_back(p, check_wad3());
+		w.set_dedup(check_dedup());
+		if (check_shards())
+			w.set_shards(check_shard_bytes(), check_shard_lumps());
+	}
+	for (std::size_t i = 0; i < lumps.size(); ++i) {
+		const entry& e = m.entries[i];
+		writers[e.wad].add(e.name, lumps[i].data(), lumps[i].size(),
+		                   wad::type_miptex);
+	}
+	for_each_job(writers.size(), [&](std::size_t i) {
+		writers[i].write();
+	});
+	std::cout << lumps.size() << " lumps from "sv << m.sources.size()
+	          << " images placed into "sv << writers.size()
+	          << " WAD files"sv << std::endl;
+	if (check_shards()) {
+		std::size_t shards = 0;
+		for (const wad::writer& w : writers)
+			shards += w.shards();
+		std::cout << "WAD files were split into "sv << shards
+		          << " shards"sv << std::endl;
+	}
+	if (check_dedup()) {
+		std::size_t shared = 0, wasted = 0;
+		for (const wad::writer& w : writers) {
+			shared += w.shared();
+			wasted += w.wasted();
+		}
+		std::cout << shared << " lumps share the data of earlier ones, "sv
+		          << wasted << " bytes are miptex copies under other "sv
+		          << "names"sv << std::endl;
+	}
+}
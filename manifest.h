@@ -0,0 +1,9 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <filesystem>
+
+// Builds the miptex lumps listed in a manifest into their WAD files
+void run_manifest(const std::filesystem::path& path);
+
+#endif
@@ -0,0 +1,43 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include <malloc.h>
+
+#include "stats.h"
+
+/*
+ * Feeds the allocation tracking of --memory. It belongs to the program
+ * rather than to the library, which must not replace the operator new of
+ * whoever links it. The other forms of operator new and delete forward to
+ * these, except the aligned ones, which are left untracked.
+ */
+
+void* operator new(std::size_t n)
+{
+	if (n == 0)
+		n = 1;
+	for (;;) {
+		if (void* const p = std::malloc(n)) {
+			if (stats::tracking_memory())
+				stats::allocated(::malloc_usable_size(p));
+			return p;
+		}
+		const std::new_handler handler = std::get_new_handler();
+		if (!handler)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+void operator delete(void* const p) noexcept
+{
+	if (p && stats::tracking_memory())
+		stats::freed(::malloc_usable_size(p));
+	std::free(p);
+}
+
+void operator delete(void* const p, std::size_t) noexcept
+{
+	::operator delete(p);
+}
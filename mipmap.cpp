@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "arena.h"
+#include "image.h"
+#include "linear.h"
+#include "mipmap.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+
+// Number of output rows diffusing their error together in banded mode
+static constexpr std::int32_t band_rows = 8;
+
+// Squared distance below which no new color is worth adding (0.001 in float)
+static constexpr std::int64_t add_threshold =
+	std::int64_t{linear::one} * linear::one / 1000;
+
+void mipmap_generator::count_color(std::int32_t x, std::int32_t y)
+{
+	const auto offset = 40 + y * width + x;
+	const auto c = std::to_integer<unsigned char>(lump[offset]);
+	if (!color_used[c]) {
+		color_used[c] = true;
+		++colors_used;
+	}
+}
+
+mipmap_generator::mipmap_generator(image& i, std::int32_t w, std::int32_t h,
+                                   const std::byte* l)
+	noexcept
+	: img{i}
+	, lump{l}
+	, scratch{scratch_arena::local()}
+	, width{w}
+	, height{h}
+	, pyramid{{std::pmr::vector<cell>(&scratch),
+	           std::pmr::vector<cell>(&scratch),
+	           std::pmr::vector<cell>(&scratch)}}
+{
+	// Linearize the palette
+	{
+		constexpr auto adjust_gamma = [](unsigned char val) {
+			return linear::decode(val);
+		};
+		img.transform_palette(linear_palette.begin(), adjust_gamma);
+	}
+
+	if (img.is_transparent()) {
+		// Assume the palette is full
+		colors_used = 255;
+		std::fill(color_used.begin(), color_used.end(), true);
+	} else {
+		std::fill(color_used.begin(), color_used.end(), false);
+		for (std::int32_t y = 0; y < height; ++y) {
+			for (std::int32_t x = 0; x < width; ++x)
+				count_color(x, y);
+		}
+	}
+	find_exact_colors();
+}
+
+mipmap_generator::color_type mipmap_generator::color_of(int c) const noexcept
+{
+	return {linear_palette[3 * c], linear_palette[3 * c + 1],
+	        linear_palette[3 * c + 2]};
+}
+
+/*
+ * The palette search returns the first used color below 255 at distance 0.
+ * Sorting those colors by value then index finds it for every index at once.
+ */
+void mipmap_generator::find_exact_colors() noexcept
+{
+	std::array<int, 255> order;
+	auto end = order.begin();
+	for (int c = 0; c < 255; ++c) {
+		if (color_used[c])
+			*end++ = c;
+	}
+	const auto less = [this](int a, int b) {
+		const color_type ca = color_of(a);
+		const color_type cb = color_of(b);
+		return ca < cb || (ca == cb && a < b);
+	};
+	std::sort(order.begin(), end, less);
+	for (int u = 0; u < 256; ++u) {
+		exact_color[u] = -1;
+		if (!color_used[u])
+			continue;
+		const color_type cu = color_of(u);
+		const auto it = std::lower_bound(order.begin(), end, cu,
+			[this](int c, const color_type& v) {
+				return color_of(c) < v;
+			});
+		if (it != end && color_of(*it) == cu)
+			exact_color[u] = *it;
+	}
+}
+
+int mipmap_generator::find_unused_color() const noexcept
+{
+	const auto begin = color_used.cbegin();
+	const auto end = color_used.cend();
+	return static_cast<int>(std::find(begin, end, false) - begin);
+}
+
+unsigned char mipmap_generator::add_color(const color_type& color)
+{
+	const auto [red, green, blue] = color;
+	const int c = find_unused_color();
+	linear_palette[3 * c] = red;
+	linear_palette[3 * c + 1] = green;
+	linear_palette[3 * c + 2] = blue;
+	img.set_color(c, linear::encode(red), linear::encode(green),
+	              linear::encode(blue));
+	color_used[c] = true;
+	++colors_used;
+	++palette_version;
+	stats::add(stats::counter::colors_added, 1);
+	// No used color below 255 matched, so only 255 may now match c
+	if (c < 255) {
+		exact_color[c] = c;
+		if (exact_color[255] < 0 && color_used[255]
+		    && color_of(255) == color)
+			exact_color[255] = c;
+	}
+	return static_cast<unsigned char>(c);
+}
+
+[[nodiscard]] static constexpr std::int64_t
+hypotsqr(std::int64_t x, std::int64_t y, std::int64_t z) noexcept
+{
+	return x * x + y * y + z * z;
+}
+
+// Rounded average of n non-negative values summing to sum
+[[nodiscard]] static constexpr linear::value_type
+divide(const std::uint32_t sum, const unsigned int n) noexcept
+{
+	return static_cast<linear::value_type>((sum + n / 2) / n);
+}
+
+mipmap_generator::color_type
+mipmap_generator::get_average_color(const pixel_block& b,
+                                    const error_state& e) const noexcept
+{
+	std::uint32_t red = 0;
+	std::uint32_t green = 0;
+	std::uint32_t blue = 0;
+	for (unsigned int i = 0; i < b.count; ++i) {
+		const unsigned int c = b.mask[i];
+		red += static_cast<std::uint32_t>(linear_palette[3 * c]);
+		green += static_cast<std::uint32_t>(linear_palette[3 * c + 1]);
+		blue += static_cast<std::uint32_t>(linear_palette[3 * c + 2]);
+	}
+	const unsigned int n = b.count;
+	return {divide(red, n) + e.red,
+	        divide(green, n) + e.green,
+	        divide(blue, n) + e.blue};
+}
+
+static constexpr std::uint64_t no_key = ~std::uint64_t{0};
+
+// Packs a color into 63 bits, or gives no_key if a channel does not fit
+[[nodiscard]] static constexpr std::uint64_t
+make_key(const std::array<linear::value_type, 3>& color) noexcept
+{
+	constexpr linear::value_type bound = 1 << 20;
+	std::uint64_t key = 0;
+	for (const linear::value_type v : color) {
+		if (v < -bound || v >= bound)
+			return no_key;
+		key = key << 21 | static_cast<std::uint64_t>(v + bound);
+	}
+	return key;
+}
+
+int mipmap_generator::average_pixels(const color_type& color, scan_state& s)
+{
+	const auto [red, green, blue] = color;
+	error_state& e = s.error;
+	color_cache& cache = s.cache;
+	const auto extract_value = [this](int c, int channel) {
+		return linear_palette[3 * c + channel];
+	};
+
+	if (cache.version != palette_version) {
+		cache.keys.fill(no_key);
+		cache.version = palette_version;
+	}
+	const std::uint64_t key = make_key(color);
+	const std::size_t slot = (key * 0x9e3779b97f4a7c15) >> 56;
+	++cache.lookups;
+	if (key != no_key && cache.keys[slot] == key) {
+		++cache.hits;
+		const int c = cache.colors[slot];
+		e.red = red - extract_value(c, 0);
+		e.green = green - extract_value(c, 1);
+		e.blue = blue - extract_value(c, 2);
+		return c;
+	}
+	const auto remember = [&cache, key, slot](int c) {
+		if (key == no_key)
+			return;
+		cache.keys[slot] = key;
+		cache.colors[slot] = static_cast<unsigned char>(c);
+	};
+
+	std::int64_t best_distortion = 3 * std::int64_t{linear::one}
+	                               * linear::one;
+	int best_color = -1;
+	for (int c = 0; c < 255; ++c) {
+		if (!color_used[c])
+			continue;
+		const auto dist_red = red - extract_value(c, 0);
+		const auto dist_green = green - extract_value(c, 1);
+		const auto dist_blue = blue - extract_value(c, 2);
+		const auto dist = hypotsqr(dist_red, dist_green, dist_blue);
+		if (dist < best_distortion) {
+			if (dist == 0) {
+				e = error_state{};
+				remember(c);
+				return c;
+			}
+			best_distortion = dist;
+			best_color = c;
+		}
+	}
+	if (best_distortion > add_threshold && colors_used < 255) {
+		best_color = add_color(color);
+		e = error_state{};
+	} else {
+		e.red = red - extract_value(best_color, 0);
+		e.green = green - extract_value(best_color, 1);
+		e.blue = blue - extract_value(best_color, 2);
+		remember(best_color);
+	}
+	return static_cast<unsigned char>(best_color);
+}
+
+/*
+ * Compares each row of the block with its first index, a whole row at a time.
+ * The bytes past the row keep the pattern, so this works whatever the byte
+ * order.
+ */
+int mipmap_generator::uniform_index(std::int32_t x, std::int32_t y,
+                                    std::int32_t step) const noexcept
+{
+	const std::byte* row = &lump[40 + y * width + x];
+	const auto v = std::to_integer<unsigned char>(row[0]);
+	const std::uint64_t pattern = 0x0101010101010101 * v;
+	for (std::int32_t j = 0; j < step; ++j, row += width) {
+		std::uint64_t word = pattern;
+		std::memcpy(&word, row, static_cast<std::size_t>(step));
+		if (word != pattern)
+			return -1;
+	}
+	return v;
+}
+
+int mipmap_generator::reduce_pixel(std::int32_t x, std::int32_t y,
+                                   const int lvl, unsigned int test,
+                                   scan_state& s)
+{
+	if (!pyramid[0].empty())
+		return reduce_cell(x, y, lvl, test, s);
+	pixel_block& b = s.block;
+	const std::int32_t step = std::int32_t{1} << lvl;
+	if (const int u = uniform_index(x, y, step); u >= 0) {
+		if (u == 255 && img.is_transparent())
+			return 0xff;
+		const error_state& e = s.error;
+		if (e.red == 0 && e.green == 0 && e.blue == 0
+		    && exact_color[u] >= 0)
+			return exact_color[u];
+	}
+	b.count = 0;
+	for (std::int32_t j = 0; j < step; ++j) {
+		for (std::int32_t i = 0; i < step; ++i) {
+			const std::byte v = lump[40 + (y + j) * width + x + i];
+			const auto p = std::to_integer<unsigned char>(v);
+			if (!img.is_transparent() || p != 255) {
+				b.mask.at(b.count) = p;
+				++b.count;
+			}
+		}
+	}
+	if (b.count <= test)
+		return 0xff;
+	return average_pixels(get_average_color(b, s.error), s);
+}
+
+int mipmap_generator::reduce_cell(std::int32_t x, std::int32_t y,
+                                  const int lvl, unsigned int test,
+                                  scan_state& s)
+{
+	const error_state& e = s.error;
+	const std::int32_t columns = width >> lvl;
+	const cell& c = pyramid[lvl - 1][(y >> lvl) * columns + (x >> lvl)];
+	if (c.count <= test)
+		return 0xff;
+	const unsigned int n = c.count;
+	return average_pixels({divide(c.red, n) + e.red,
+	                       divide(c.green, n) + e.green,
+	                       divide(c.blue, n) + e.blue}, s);
+}
+
+/*
+ * Each cell holds the sums of the linear colors of the opaque texels it
+ * covers, so that averaging the 4 cells below it gives exactly the same color
+ * as averaging every texel of the block.
+ */
+void mipmap_generator::cascade()
+{
+	const auto add_texel = [this](cell& c, std::int32_t x, std::int32_t y) {
+		const std::byte v = lump[40 + y * width + x];
+		const auto p = std::to_integer<unsigned char>(v);
+		if (img.is_transparent() && p == 255)
+			return;
+		c.red += static_cast<std::uint32_t>(linear_palette[3 * p]);
+		c.green += static_cast<std::uint32_t>(linear_palette[3 * p + 1]);
+		c.blue += static_cast<std::uint32_t>(linear_palette[3 * p + 2]);
+		++c.count;
+	};
+
+	std::pmr::vector<cell>& first = pyramid[0];
+	first.resize(static_cast<std::size_t>((width / 2) * (height / 2)));
+	auto out = first.begin();
+	for (std::int32_t y = 0; y < height; y += 2) {
+		for (std::int32_t x = 0; x < width; x += 2, ++out) {
+			add_texel(*out, x, y);
+			add_texel(*out, x + 1, y);
+			add_texel(*out, x, y + 1);
+			add_texel(*out, x + 1, y + 1);
+		}
+	}
+
+	for (int lvl = 2; lvl < 4; ++lvl) {
+		const std::pmr::vector<cell>& src = pyramid[lvl - 2];
+		const std::int32_t src_width = width >> (lvl - 1);
+		const std::int32_t w = width >> lvl;
+		const std::int32_t h = height >> lvl;
+		std::pmr::vector<cell>& dst = pyramid[lvl - 1];
+		dst.resize(static_cast<std::size_t>(w * h));
+		for (std::int32_t y = 0; y < h; ++y) {
+			for (std::int32_t x = 0; x < w; ++x) {
+				cell& d = dst[y * w + x];
+				const auto top = 2 * y * src_width + 2 * x;
+				for (const auto s : {top, top + 1,
+				                     top + src_width,
+				                     top + src_width + 1}) {
+					d.red += src[s].red;
+					d.green += src[s].green;
+					d.blue += src[s].blue;
+					d.count = static_cast<std::uint16_t>(
+						d.count + src[s].count);
+				}
+			}
+		}
+	}
+}
+
+// Span names of the levels, which must outlive the spans
+static constexpr const char* level_names[] = {
+	"mip level 1", "mip level 2", "mip level 3"
+};
+
+std::string_view mipmap_generator::lump_name() const noexcept
+{
+	const auto name = reinterpret_cast<const char*>(lump);
+	return {name, ::strnlen(name, 16)};
+}
+
+void mipmap_generator::report(const scan_state& s) noexcept
+{
+	stats::add(stats::counter::color_lookups, s.cache.lookups);
+	stats::add(stats::counter::color_cache_hits, s.cache.hits);
+}
+
+mipmap_generator::mipmap_type mipmap_generator::generate(const int lvl)
+{
+	const trace::span span(level_names[lvl - 1], lump_name());
+	scan_state s;
+	std::int32_t step = std::int32_t{1} << lvl;
+	const unsigned int test = (step * step * 2) / 5; // 40%
+	mipmap_type mipmap(&scratch);
+	mipmap.reserve((height >> lvl) * (width >> lvl));
+	for (std::int32_t y = 0; y < height; y += step) {
+		for (std::int32_t x = 0; x < width; x += step) {
+			const int c = reduce_pixel(x, y, lvl, test, s);
+			using std::byte;
+			mipmap.push_back(byte{static_cast<unsigned char>(c)});
+		}
+	}
+	report(s);
+	stats::add(stats::counter::texels_reduced, mipmap.size());
+	return mipmap;
+}
+
+void mipmap_generator::reduce_band(const int lvl, const std::int32_t first,
+                                   const std::int32_t last, std::byte* out)
+{
+	const trace::span span(level_names[lvl - 1], lump_name());
+	scan_state s;
+	const std::int32_t step = std::int32_t{1} << lvl;
+	const unsigned int test = (step * step * 2) / 5; // 40%
+	for (std::int32_t y = first * step; y < last * step; y += step) {
+		for (std::int32_t x = 0; x < width; x += step) {
+			const int c = reduce_pixel(x, y, lvl, test, s);
+			*out++ = std::byte{static_cast<unsigned char>(c)};
+		}
+	}
+	report(s);
+	const auto texels = (last - first) * (width / step);
+	stats::add(stats::counter::texels_reduced,
+	           static_cast<std::uint64_t>(texels));
+}
+
+/*
+ * The palette is full, so every band maps its texels to the same colors
+ * whichever runs first and the result never depends on the number of threads.
+ */
+std::array<mipmap_generator::mipmap_type, 3>
+mipmap_generator::generate_banded(worker_pool& pool)
+{
+	struct band {
+		int lvl;
+		std::int32_t first;
+		std::int32_t last;
+		std::byte* out;
+	};
+
+	std::array<mipmap_type, 3> levels{mipmap_type(&scratch),
+	                                  mipmap_type(&scratch),
+	                                  mipmap_type(&scratch)};
+	std::pmr::vector<band> bands(&scratch);
+	bands.reserve(static_cast<std::size_t>(3 * height / band_rows));
+	for (int lvl = 1; lvl < 4; ++lvl) {
+		const std::int32_t rows = height >> lvl;
+		const std::int32_t columns = width >> lvl;
+		mipmap_type& m = levels[lvl - 1];
+		m.resize(static_cast<std::size_t>(rows * columns));
+		for (std::int32_t y = 0; y < rows; y += band_rows) {
+			const std::int32_t last = std::min(y + band_rows, rows);
+			bands.push_back({lvl, y, last, &m[y * columns]});
+		}
+	}
+
+	pool.for_each(bands.size(), [this, &bands](std::size_t i) {
+		const band& b = bands[i];
+		reduce_band(b.lvl, b.first, b.last, b.out);
+	});
+	return levels;
+}
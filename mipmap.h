@@ -0,0 +1,128 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+#include "linear.h"
+
+class image;
+class worker_pool;
+
+// Scratch buffers come from the arena of the calling thread
+class mipmap_generator {
+public:
+	using mipmap_type = std::pmr::vector<std::byte>;
+
+	// l is a miptex lump holding at least its header and level 0
+	mipmap_generator(image& i, std::int32_t w, std::int32_t h,
+	                 const std::byte* l) noexcept;
+	mipmap_generator(const mipmap_generator&) = delete;
+	mipmap_generator& operator=(const mipmap_generator&) = delete;
+
+	// Precomputes levels 1 to 3 from each other instead of from level 0
+	void cascade();
+
+	// Diffuses the error across the whole level
+	[[nodiscard]] mipmap_type generate(int lvl);
+
+	// Whether no color can be added, which generate_banded() requires
+	[[nodiscard]] bool palette_full() const noexcept
+	{
+		return colors_used >= 255;
+	}
+
+	// Diffuses the error separately in fixed row bands of levels 1 to 3
+	[[nodiscard]] std::array<mipmap_type, 3> generate_banded(worker_pool& p);
+
+private:
+	using color_type = std::array<linear::value_type, 3>;
+
+	struct error_state {
+		linear::value_type red = 0;
+		linear::value_type green = 0;
+		linear::value_type blue = 0;
+	};
+
+	struct pixel_block {
+		std::array<unsigned char, 256> mask{};
+		std::uint_fast8_t count = 0;
+	};
+
+	// Direct-mapped memo of palette searches, exact for one palette version
+	struct color_cache {
+		static constexpr std::size_t size = 256;
+
+		std::array<std::uint64_t, size> keys{};
+		std::array<unsigned char, size> colors{};
+		unsigned int version = ~0u;
+		std::uint64_t hits = 0;
+		std::uint64_t lookups = 0;
+	};
+
+	// What a raster scan of a level or a band carries from pixel to pixel
+	struct scan_state {
+		pixel_block block{};
+		error_state error{};
+		color_cache cache{};
+	};
+
+	struct cell {
+		std::uint32_t red = 0;
+		std::uint32_t green = 0;
+		std::uint32_t blue = 0;
+		std::uint16_t count = 0;
+	};
+
+	void count_color(std::int32_t x, std::int32_t y);
+	void find_exact_colors() noexcept;
+
+	[[nodiscard]] color_type color_of(int c) const noexcept;
+
+	[[nodiscard]] color_type
+	get_average_color(const pixel_block& b, const error_state& e)
+		const noexcept;
+
+	int average_pixels(const color_type& color, scan_state& s);
+	unsigned char add_color(const color_type& color);
+	int find_unused_color() const noexcept;
+
+	[[nodiscard]] int
+	uniform_index(std::int32_t x, std::int32_t y, std::int32_t step)
+		const noexcept;
+
+	int reduce_pixel(std::int32_t x, std::int32_t y, int lvl,
+	                 unsigned int test, scan_state& s);
+
+	int reduce_cell(std::int32_t x, std::int32_t y, int lvl,
+	                unsigned int test, scan_state& s);
+
+	// Name the lump starts with, for traces
+	[[nodiscard]] std::string_view lump_name() const noexcept;
+
+	static void report(const scan_state& s) noexcept;
+
+	void reduce_band(int lvl, std::int32_t first, std::int32_t last,
+	                 std::byte* out);
+
+	image& img;
+	const std::byte* lump;
+	std::pmr::memory_resource& scratch;
+	const std::int32_t width;
+	const std::int32_t height;
+
+	std::array<linear::value_type, 768> linear_palette{};
+	unsigned int colors_used = 0;
+	std::array<bool, 256> color_used{};
+	unsigned int palette_version = 0;
+
+	// What the palette search gives for each index with no error to diffuse
+	std::array<int, 256> exact_color{};
+	std::array<std::pmr::vector<cell>, 3> pyramid;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "pool.h"
+
+struct worker_pool::range {
+	std::mutex mutex{};
+	std::size_t begin = 0;
+	std::size_t end = 0;
+};
+
+struct worker_pool::batch {
+	batch(std::size_t n, const task_type& f, std::size_t s)
+		: size{n}
+		, task{f}
+		, slots{s}
+		, ranges{std::make_unique<range[]>(s)}
+	{
+		for (std::size_t i = 0; i < slots; ++i) {
+			ranges[i].begin = i * size / slots;
+			ranges[i].end = (i + 1) * size / slots;
+		}
+	}
+
+	const std::size_t size;
+	const task_type& task;
+	const std::size_t slots;
+	const std::unique_ptr<range[]> ranges;
+	std::atomic<std::size_t> joined{0};
+	std::atomic<std::size_t> taken{0};
+	std::size_t done = 0;
+	std::exception_ptr error{};
+	std::mutex mutex{};
+	std::condition_variable finished{};
+};
+
+worker_pool::worker_pool(const unsigned int jobs)
+{
+	if (jobs > 1)
+		threads.reserve(jobs - 1);
+	for (unsigned int j = 1; j < jobs; ++j)
+		threads.emplace_back(&worker_pool::work, this);
+}
+
+worker_pool::~worker_pool() noexcept
+{
+	{
+		const std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads)
+		t.join();
+}
+
+bool worker_pool::take(batch& b, const std::size_t slot, std::size_t& i)
+{
+	range& own = b.ranges[slot];
+	{
+		const std::lock_guard lock(own.mutex);
+		if (own.begin < own.end) {
+			i = own.begin++;
+			return true;
+		}
+	}
+	for (std::size_t k = 1; k < b.slots; ++k) {
+		range& victim = b.ranges[(slot + k) % b.slots];
+		std::size_t first, last;
+		{
+			const std::lock_guard lock(victim.mutex);
+			if (victim.begin >= victim.end)
+				continue;
+			last = victim.end;
+			first = last - (last - victim.begin + 1) / 2;
+			victim.end = first;
+		}
+		const std::lock_guard lock(own.mutex);
+		own.begin = first + 1;
+		own.end = last;
+		i = first;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Each call takes a slot of its own, so that only its thread ever installs a
+ * stolen range there. Calls past the last slot have nothing to do, since the
+ * ranges of slots nobody joined are stolen from by those who did.
+ */
+void worker_pool::run_tasks(batch& b)
+{
+	const std::size_t slot = b.joined.fetch_add(1);
+	if (slot >= b.slots)
+		return;
+	std::size_t count = 0;
+	std::exception_ptr error;
+	std::size_t i;
+	while (take(b, slot, i)) {
+		b.taken.fetch_add(1);
+		try {
+			b.task(i);
+		} catch (...) {
+			if (!error)
+				error = std::current_exception();
+		}
+		++count;
+	}
+	if (count == 0)
+		return;
+	const std::lock_guard lock(b.mutex);
+	if (error && !b.error)
+		b.error = error;
+	b.done += count;
+	if (b.done == b.size)
+		b.finished.notify_all();
+}
+
+void worker_pool::work()
+{
+	for (;;) {
+		std::shared_ptr<batch> b;
+		{
+			std::unique_lock lock(mutex);
+			wake.wait(lock, [this] {
+				return stopping || !pending.empty();
+			});
+			if (pending.empty())
+				return;
+			// Newest first, so that nested batches get help
+			b = pending.back();
+			if (b->taken.load() >= b->size
+			    || b->joined.load() >= b->slots) {
+				pending.pop_back();
+				continue;
+			}
+		}
+		run_tasks(*b);
+	}
+}
+
+void worker_pool::for_each(const std::size_t n, const task_type& f)
+{
+	if (n == 0)
+		return;
+	const auto b = std::make_shared<batch>(n, f, jobs());
+	if (!threads.empty() && n > 1) {
+		{
+			const std::lock_guard lock(mutex);
+			pending.push_back(b);
+		}
+		wake.notify_all();
+	}
+	run_tasks(*b);
+	{
+		std::unique_lock lock(b->mutex);
+		b->finished.wait(lock, [&b] { return b->done == b->size; });
+	}
+	if (b->error)
+		std::rethrow_exception(b->error);
+}
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads running indexed batches of tasks. Each batch is
+ * split in one range of indices per thread, and threads whose range runs out
+ * steal half of what is left in another.
+ */
+class worker_pool {
+public:
+	using task_type = std::function<void(std::size_t)>;
+
+	explicit worker_pool(unsigned int jobs);
+	worker_pool(const worker_pool&) = delete;
+	worker_pool& operator=(const worker_pool&) = delete;
+	~worker_pool() noexcept;
+
+	// Calls f(i) for each i in [0, n) and returns when all calls are done.
+	// The calling thread takes part, which makes nested calls safe.
+	void for_each(std::size_t n, const task_type& f);
+
+	[[nodiscard]] unsigned int jobs() const noexcept {
+		return static_cast<unsigned int>(threads.size()) + 1;
+	}
+
+private:
+	struct range;
+	struct batch;
+
+	void work();
+	static void run_tasks(batch& b);
+	[[nodiscard]] static bool take(batch& b, std::size_t slot,
+	                               std::size_t& i);
+
+	std::mutex mutex{};
+	std::condition_variable wake{};
+	std::deque<std::shared_ptr<batch>> pending{};
+	bool stopping = false;
+	std::vector<std::thread> threads{};
+};
+
+#endif
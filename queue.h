@@ -0,0 +1,83 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+/*
+ * Queue between pipeline stages, holding items up to a total weight. An item
+ * heavier than the capacity still goes through once the queue is empty.
+ */
+template<class T>
+class bounded_queue {
+public:
+	explicit bounded_queue(std::size_t c) noexcept : capacity{c} {}
+	bounded_queue(const bounded_queue&) = delete;
+	bounded_queue& operator=(const bounded_queue&) = delete;
+
+	// Waits for room, and tells whether the item is still wanted
+	[[nodiscard]] bool push(T item, std::size_t weight = 1) {
+		std::unique_lock lock(mutex);
+		changed.wait(lock, [&] {
+			return cancelled || used == 0
+			       || used + weight <= capacity;
+		});
+		if (cancelled)
+			return false;
+		items.push_back({std::move(item), weight});
+		used += weight;
+		changed.notify_all();
+		return true;
+	}
+
+	// Waits for an item, or gives none once the queue is closed and empty
+	[[nodiscard]] std::optional<T> pop() {
+		std::unique_lock lock(mutex);
+		changed.wait(lock, [this] {
+			return cancelled || closed || !items.empty();
+		});
+		if (cancelled || items.empty())
+			return std::nullopt;
+		entry e = std::move(items.front());
+		items.pop_front();
+		used -= e.weight;
+		changed.notify_all();
+		return std::move(e.item);
+	}
+
+	// Called by the producer once it is done
+	void close() {
+		const std::lock_guard lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+	// Called by the consumer when it stops early
+	void cancel() {
+		const std::lock_guard lock(mutex);
+		cancelled = true;
+		items.clear();
+		used = 0;
+		changed.notify_all();
+	}
+
+private:
+	struct entry {
+		T item;
+		std::size_t weight;
+	};
+
+	std::mutex mutex{};
+	std::condition_variable changed{};
+	std::deque<entry> items{};
+	std::size_t used = 0;
+	const std::size_t capacity;
+	bool closed = false;
+	bool cancelled = false;
+};
+
+#endif
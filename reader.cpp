@@ -0,0 +1,195 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "byte.h"
+#include "cmd.h"
+#include "wad.h"
+
+namespace {
+
+constexpr std::size_t header_size = 12;
+
+[[nodiscard]] std::system_error
+system_error(const char* func, unsigned int line,
+             const std::filesystem::path& path)
+{
+	const int e = errno;
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": Could not map WAD file "
+	  << path;
+	return std::system_error(e, std::generic_category(), s.str());
+}
+
+[[nodiscard]] std::invalid_argument
+bad_wad(const char* func, unsigned int line,
+        const std::filesystem::path& path, std::string_view what)
+{
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": Invalid WAD file "
+	  << path << ": " << what;
+	return std::invalid_argument(s.str());
+}
+
+[[nodiscard]] std::invalid_argument
+bad_miptex(const char* func, unsigned int line, std::string_view what)
+{
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": Invalid miptex: "
+	  << what;
+	return std::invalid_argument(s.str());
+}
+
+}
+
+/*
+ * The header and directory are checked here, but not the data of entries,
+ * so that a WAD file with a few bad entries can still be read and checked.
+ */
+wad::reader::reader(const std::filesystem::path& p)
+	: file_path{expand(p)}
+{
+	const int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error(__func__, __LINE__, file_path);
+	struct stat st{};
+	if (::fstat(fd, &st) < 0) {
+		const auto e = system_error(__func__, __LINE__, file_path);
+		::close(fd);
+		throw e;
+	}
+	size = static_cast<std::size_t>(st.st_size);
+	if (size < header_size) {
+		::close(fd);
+		throw bad_wad(__func__, __LINE__, file_path,
+		              "shorter than a header");
+	}
+	void* const map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		throw system_error(__func__, __LINE__, file_path);
+	bytes = static_cast<const std::byte*>(map);
+
+	try {
+		const auto head = reinterpret_cast<const char*>(bytes);
+		const std::string_view magic(head, 4);
+		if (magic != "WAD2" && magic != "WAD3")
+			throw bad_wad(__func__, __LINE__, file_path,
+			              "wrong magic number");
+		is_wad3 = magic[3] == '3';
+		const auto n = get_little_endian<std::int32_t>(bytes + 4);
+		const auto table = get_little_endian<std::int32_t>(bytes + 8);
+		if (n < 0 || table < 0
+		    || static_cast<std::size_t>(table) > size
+		    || (size - static_cast<std::size_t>(table))
+		       / wad::entry_size < static_cast<std::size_t>(n))
+			throw bad_wad(__func__, __LINE__, file_path,
+			              "directory out of bounds");
+		directory.reserve(static_cast<std::size_t>(n));
+		for (std::int32_t i = 0; i < n; ++i) {
+			const std::byte* const e = bytes + table
+			                           + i * wad::entry_size;
+			const auto name = reinterpret_cast<const char*>(e + 16);
+			directory.push_back({
+				std::string(name, ::strnlen(name, 16)),
+				std::to_integer<char>(e[12]),
+				e[13] != std::byte{0},
+				get_little_endian<std::uint32_t>(e),
+				get_little_endian<std::uint32_t>(e + 4)
+			});
+		}
+	} catch (...) {
+		::munmap(const_cast<std::byte*>(bytes), size);
+		throw;
+	}
+}
+
+wad::reader::~reader() noexcept
+{
+	::munmap(const_cast<std::byte*>(bytes), size);
+}
+
+bool wad::reader::in_bounds(const entry& e) const noexcept
+{
+	return e.offset <= size && e.size <= size - e.offset;
+}
+
+const std::byte* wad::reader::data(const entry& e) const
+{
+	if (!in_bounds(e)) {
+		std::ostringstream s;
+		s << "lump " << e.name << " out of bounds";
+		throw bad_wad(__func__, __LINE__, file_path, s.str());
+	}
+	return bytes + e.offset;
+}
+
+wad::miptex_view::miptex_view(const std::byte* d, const std::size_t size,
+                              const bool wad3)
+	: data{d}
+{
+	if (size < wad::miptex_header_size)
+		throw bad_miptex(__func__, __LINE__, "shorter than a header");
+	w = get_little_endian<std::int32_t>(data + 16);
+	h = get_little_endian<std::int32_t>(data + 20);
+	if (w <= 0 || h <= 0 || w > wad::max_miptex_side
+	    || h > wad::max_miptex_side) {
+		std::ostringstream s;
+		s << "dimensions " << w << 'x' << h;
+		throw bad_miptex(__func__, __LINE__, s.str());
+	}
+	for (int lvl = 0; lvl < 4; ++lvl) {
+		const auto o = get_little_endian<std::uint32_t>(
+			data + 24 + 4 * lvl);
+		offsets[lvl] = o;
+		if (o < wad::miptex_header_size || o > size
+		    || level_size(lvl) > size - o) {
+			std::ostringstream s;
+			s << "level " << lvl << " out of bounds";
+			throw bad_miptex(__func__, __LINE__, s.str());
+		}
+	}
+	if (!wad3)
+		return;
+	const std::size_t at = offsets[3] + level_size(3);
+	if (size - at < 2)
+		throw bad_miptex(__func__, __LINE__, "no palette");
+	palette_offset = at;
+	count = get_little_endian<std::uint16_t>(data + at);
+	if (count > 256 || (size - at - 2) / 3 < count) {
+		std::ostringstream s;
+		s << "palette of " << count << " colors out of bounds";
+		throw bad_miptex(__func__, __LINE__, s.str());
+	}
+}
+
+std::string_view wad::miptex_view::name() const noexcept
+{
+	const auto n = reinterpret_cast<const char*>(data);
+	return {n, ::strnlen(n, 16)};
+}
+
+const std::byte* wad::miptex_view::palette() const noexcept
+{
+	return palette_offset > 0 ? data + palette_offset + 2 : nullptr;
+}
+
+std::size_t wad::miptex_view::used() const noexcept
+{
+	if (palette_offset > 0)
+		return palette_offset + 2 + 3 * count;
+	return offsets[3] + level_size(3);
+}
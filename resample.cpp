@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "image.h"
+#include "linear.h"
+
+namespace {
+
+// Source pixels and weights contributing to one output pixel along an axis
+struct contribution {
+	std::int32_t first = 0;
+	std::vector<float> weights{};
+};
+
+/*
+ * Tent filter, widened by the scale factor when shrinking so that every
+ * source pixel contributes to the output.
+ */
+std::vector<contribution> make_contributions(std::int32_t src, std::int32_t dst)
+{
+	const float scale = static_cast<float>(dst) / static_cast<float>(src);
+	const float support = scale < 1.f ? 1.f / scale : 1.f;
+	std::vector<contribution> result(static_cast<std::size_t>(dst));
+	for (std::int32_t i = 0; i < dst; ++i) {
+		const float center = (static_cast<float>(i) + .5f) / scale;
+		const auto lo = static_cast<std::int32_t>(
+			std::floor(center - support));
+		const auto hi = static_cast<std::int32_t>(
+			std::ceil(center + support));
+		contribution& c = result[static_cast<std::size_t>(i)];
+		c.first = std::max(lo, std::int32_t{0});
+		float total = 0.f;
+		for (std::int32_t j = c.first; j < std::min(hi, src); ++j) {
+			const float d = std::abs(static_cast<float>(j) + .5f
+			                         - center) / support;
+			const float w = std::max(0.f, 1.f - d);
+			c.weights.push_back(w);
+			total += w;
+		}
+		for (float& w : c.weights)
+			w /= total;
+	}
+	return result;
+}
+
+// Premultiplied linear color
+struct sample {
+	float red = 0.f;
+	float green = 0.f;
+	float blue = 0.f;
+	float alpha = 0.f;
+};
+
+}
+
+/*
+ * Filters in linear light with the transparent index as zero coverage. An
+ * output pixel is transparent when at most 40% of it is covered, like when
+ * reducing mipmaps. Others get the closest palette color.
+ */
+void image::resample(const std::int32_t w, const std::int32_t h)
+{
+	if (w <= 0 || h <= 0) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Invalid target dimensions " << w << 'x' << h;
+		throw std::invalid_argument(s.str());
+	}
+	if (!data || (w == width && h == height))
+		return;
+
+	std::array<std::array<float, 3>, 256> lin;
+	for (int c = 0; c < 256; ++c) {
+		for (int s = 0; s < 3; ++s) {
+			const auto v = std::to_integer<unsigned char>(
+				palette[3 * c + s]);
+			lin[c][s] = static_cast<float>(linear::decode(v))
+			            / linear::one;
+		}
+	}
+
+	const auto columns = make_contributions(width, w);
+	const auto rows = make_contributions(height, h);
+
+	// Horizontal pass, one row of the source at a time
+	std::vector<sample> tmp(static_cast<std::size_t>(w * height));
+	for (std::int32_t y = 0; y < height; ++y) {
+		const std::byte* src = data + y * width;
+		sample* out = &tmp[static_cast<std::size_t>(y * w)];
+		for (const contribution& c : columns) {
+			sample acc;
+			for (std::size_t k = 0; k < c.weights.size(); ++k) {
+				const auto p = std::to_integer<unsigned char>(
+					src[c.first + static_cast<int>(k)]);
+				if (transparent && p == 255)
+					continue;
+				const float wt = c.weights[k];
+				acc.red += wt * lin[p][0];
+				acc.green += wt * lin[p][1];
+				acc.blue += wt * lin[p][2];
+				acc.alpha += wt;
+			}
+			*out++ = acc;
+		}
+	}
+
+	const int searched = transparent ? 255 : 256;
+	auto result = std::make_unique<std::byte[]>(
+		static_cast<std::size_t>(w * h));
+	for (std::int32_t y = 0; y < h; ++y) {
+		const contribution& r = rows[static_cast<std::size_t>(y)];
+		for (std::int32_t x = 0; x < w; ++x) {
+			sample acc;
+			for (std::size_t k = 0; k < r.weights.size(); ++k) {
+				const auto sy = r.first + static_cast<int>(k);
+				const sample& s = tmp[
+					static_cast<std::size_t>(sy * w + x)];
+				const float wt = r.weights[k];
+				acc.red += wt * s.red;
+				acc.green += wt * s.green;
+				acc.blue += wt * s.blue;
+				acc.alpha += wt * s.alpha;
+			}
+			std::byte& out = result[static_cast<std::size_t>(y * w
+			                                                 + x)];
+			if (transparent && acc.alpha <= .4f) {
+				out = std::byte{0xff};
+				continue;
+			}
+			const float red = acc.red / acc.alpha;
+			const float green = acc.green / acc.alpha;
+			const float blue = acc.blue / acc.alpha;
+			float best = std::numeric_limits<float>::max();
+			int best_color = 0;
+			for (int c = 0; c < searched; ++c) {
+				const float dr = red - lin[c][0];
+				const float dg = green - lin[c][1];
+				const float db = blue - lin[c][2];
+				const float d = dr * dr + dg * dg + db * db;
+				if (d < best) {
+					best = d;
+					best_color = c;
+				}
+			}
+			out = std::byte{static_cast<unsigned char>(best_color)};
+		}
+	}
+
+	delete[] data;
+	data = result.release();
+	width = w;
+	height = h;
+}
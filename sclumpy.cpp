@@ -1,15 +1,26 @@
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <locale>
 #include <stdexcept>
 
 #include "arg.h"
 #include "cmd.h"
+#include "check.h"
+#include "diff.h"
+#include "extract.h"
+#include "manifest.h"
 #include "script.h"
+#include "serve.h"
 #include "spray.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
 
 using namespace std::literals;
 
@@ -17,10 +28,16 @@ namespace {
 
 class inconsistent_option : public std::invalid_argument {
 public:
-	inconsistent_option(const char c) : std::invalid_argument(make(c)) {}
+	inconsistent_option(const char c)
+		: inconsistent_option(std::string_view(&c, 1))
+	{}
+
+	inconsistent_option(std::string_view o)
+		: std::invalid_argument(make(o))
+	{}
 
 private:
-	static std::string make(const char c) {
+	static std::string make(std::string_view c) {
 		std::ostringstream s;
 		s << "Option "sv << c << " contradicts previous options"sv;
 		return s.str();
@@ -29,10 +46,16 @@ private:
 
 class missing_operand : public std::invalid_argument {
 public:
-	missing_operand(const char c) : std::invalid_argument(make(c)) {}
+	missing_operand(const char c)
+		: missing_operand(std::string_view(&c, 1))
+	{}
+
+	missing_operand(std::string_view o)
+		: std::invalid_argument(make(o))
+	{}
 
 private:
-	static std::string make(const char c) {
+	static std::string make(std::string_view c) {
 		std::ostringstream s;
 		s << "Option "sv << c << " has no operand"sv;
 		return s.str();
@@ -41,10 +64,16 @@ private:
 
 class unknown_option : public std::invalid_argument {
 public:
-	unknown_option(const char c) : std::invalid_argument(make(c)) {}
+	unknown_option(const char c)
+		: unknown_option(std::string_view(&c, 1))
+	{}
+
+	unknown_option(std::string_view o)
+		: std::invalid_argument(make(o))
+	{}
 
 private:
-	static std::string make(const char c) {
+	static std::string make(std::string_view c) {
 		std::ostringstream s;
 		s << "Option "sv << c << " is unknown"sv;
 		return s.str();
@@ -63,6 +92,131 @@ private:
 	}
 };
 
+class bad_budget : public std::invalid_argument {
+public:
+	bad_budget(std::string_view a) : std::invalid_argument(make(a)) {}
+
+private:
+	static std::string make(std::string_view a) {
+		std::ostringstream s;
+		s << "Invalid pixel budget: "sv << a;
+		return s.str();
+	}
+};
+
+class bad_job_number : public std::invalid_argument {
+public:
+	bad_job_number(std::string_view a) : std::invalid_argument(make(a)) {}
+
+private:
+	static std::string make(std::string_view a) {
+		std::ostringstream s;
+		s << "Invalid number of jobs: "sv << a;
+		return s.str();
+	}
+};
+
+class bad_shard_limit : public std::invalid_argument {
+public:
+	bad_shard_limit(std::string_view a) : std::invalid_argument(make(a)) {}
+
+private:
+	static std::string make(std::string_view a) {
+		std::ostringstream s;
+		s << "Invalid shard limit: "sv << a;
+		return s.str();
+	}
+};
+
+// Writes what --stats and --trace collected once done, even after a failure
+class run_reports {
+public:
+	run_reports() = default;
+	run_reports(const run_reports&) = delete;
+	run_reports& operator=(const run_reports&) = delete;
+	~run_reports() noexcept;
+
+	void enable_stats(std::filesystem::path p) {
+		stats_path = std::move(p);
+		stats::enable();
+	}
+
+	void enable_memory() noexcept {
+		stats::track_memory();
+	}
+
+	void enable_trace(std::filesystem::path p) {
+		trace_path = std::move(p);
+		trace::enable();
+	}
+
+private:
+	std::filesystem::path stats_path{}; // empty for standard error
+	std::filesystem::path trace_path{};
+};
+
+// An empty path is standard error
+template<typename F>
+void write_report(const std::filesystem::path& path, std::string_view what,
+                  F write) noexcept
+{
+	try {
+		if (path.empty()) {
+			write(std::cerr);
+			return;
+		}
+		std::ofstream out(path);
+		write(out);
+		out.close();
+		if (!out)
+			std::cerr << "Could not write "sv << what << " to "sv
+			          << path << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Could not write "sv << what << ":\n"sv
+		          << e.what() << std::endl;
+	}
+}
+
+run_reports::~run_reports() noexcept
+{
+	if (stats::enabled())
+		write_report(stats_path, "statistics"sv, stats::write_json);
+	if (trace::enabled())
+		write_report(trace_path, "trace"sv, trace::write_json);
+}
+
+}
+
+static unsigned int parse_jobs(const std::string_view a)
+{
+	unsigned int jobs = 0;
+	const auto [end, ec] = std::from_chars(a.data(), a.data() + a.size(),
+	                                       jobs);
+	if (ec != std::errc{} || end != a.data() + a.size() || jobs == 0)
+		throw bad_job_number(a);
+	return jobs;
+}
+
+static std::int32_t parse_budget(const std::string_view a)
+{
+	std::int32_t budget = 0;
+	const auto [end, ec] = std::from_chars(a.data(), a.data() + a.size(),
+	                                       budget);
+	if (ec != std::errc{} || end != a.data() + a.size() || budget < 256)
+		throw bad_budget(a);
+	return budget;
+}
+
+static std::size_t parse_shard_limit(const std::string_view a,
+                                     const std::size_t max)
+{
+	std::size_t limit = 0;
+	const auto [end, ec] = std::from_chars(a.data(), a.data() + a.size(),
+	                                       limit);
+	if (ec != std::errc{} || end != a.data() + a.size() || limit == 0
+	    || limit > max)
+		throw bad_shard_limit(a);
+	return limit;
 }
 
 static std::filesystem::path default_output(const std::filesystem::path& path)
@@ -72,10 +226,31 @@ static std::filesystem::path default_output(const std::filesystem::path& path)
 
 static void parse_arguments_and_run(const int argc, char* const argv[])
 {
-	argument_parser arg(argc, argv, ":8sp:");
-	std::filesystem::path project;
+	enum {
+		opt_atlas = 256, opt_check, opt_diff, opt_memory, opt_serve,
+		opt_shard_bytes, opt_shard_lumps, opt_stats, opt_stats_file,
+		opt_trace
+	};
+	static constexpr long_option long_options[] = {
+		{"atlas"sv, false, opt_atlas},
+		{"check"sv, false, opt_check},
+		{"diff"sv, false, opt_diff},
+		{"memory"sv, false, opt_memory},
+		{"serve"sv, true, opt_serve},
+		{"shard-bytes"sv, true, opt_shard_bytes},
+		{"shard-lumps"sv, true, opt_shard_lumps},
+		{"stats"sv, false, opt_stats},
+		{"stats-file"sv, true, opt_stats_file},
+		{"trace"sv, true, opt_trace},
+	};
+	run_reports reports;
+	argument_parser arg(argc, argv, ":8cdf:j:mo:sp:wx", long_options);
+	std::filesystem::path project, spray_dir, socket_path;
+	std::int32_t budget = 0;
 	int c;
-	bool lumpy = false, do_spray = false;
+	bool lumpy = false, do_spray = false, watch = false;
+	bool from_manifest = false, extract = false, diff = false;
+	bool check = false;
 	while ((c = arg()) >= 0) {
 		switch (c) {
 		case '8':
@@ -84,6 +259,34 @@ static void parse_arguments_and_run(const int argc, char* const argv[])
 			plan_wad2();
 			lumpy = true;
 			break;
+		case 'c':
+			plan_cascade();
+			break;
+		case 'd':
+			if (do_spray)
+				throw inconsistent_option('d');
+			plan_dedup();
+			lumpy = true;
+			break;
+		case 'f':
+			if (lumpy)
+				throw inconsistent_option('f');
+			budget = parse_budget(arg.argument());
+			break;
+		case 'j':
+			plan_jobs(parse_jobs(arg.argument()));
+			break;
+		case 'm':
+			if (do_spray || watch)
+				throw inconsistent_option('m');
+			from_manifest = true;
+			lumpy = true;
+			break;
+		case 'o':
+			if (lumpy)
+				throw inconsistent_option('o');
+			spray_dir = arg.argument();
+			break;
 		case 's':
 			if (lumpy)
 				throw inconsistent_option('s');
@@ -95,23 +298,118 @@ static void parse_arguments_and_run(const int argc, char* const argv[])
 			project = arg.argument();
 			lumpy = true;
 			break;
+		case 'w':
+			if (do_spray || from_manifest)
+				throw inconsistent_option('w');
+			watch = true;
+			lumpy = true;
+			break;
+		case 'x':
+			extract = true;
+			break;
+		case opt_serve:
+			socket_path = arg.argument();
+			break;
+		case opt_shard_bytes:
+			if (do_spray)
+				throw inconsistent_option("--shard-bytes"sv);
+			plan_shard_bytes(parse_shard_limit(arg.argument(),
+			                                   INT32_MAX));
+			lumpy = true;
+			break;
+		case opt_shard_lumps:
+			if (do_spray)
+				throw inconsistent_option("--shard-lumps"sv);
+			plan_shard_lumps(parse_shard_limit(arg.argument(),
+			                                   4096));
+			lumpy = true;
+			break;
+		case opt_atlas:
+			if (do_spray)
+				throw inconsistent_option("--atlas"sv);
+			plan_atlas();
+			lumpy = true;
+			break;
+		case opt_check:
+			check = true;
+			break;
+		case opt_diff:
+			diff = true;
+			break;
+		case opt_memory:
+			reports.enable_memory();
+			break;
+		case opt_stats:
+			reports.enable_stats({});
+			break;
+		case opt_stats_file:
+			reports.enable_stats(arg.argument());
+			break;
+		case opt_trace:
+			reports.enable_trace(arg.argument());
+			break;
 		case ':':
-			throw missing_operand(arg.error());
+			throw missing_operand(arg.error_name());
 		default:
-			throw unknown_option(arg.error());
+			throw unknown_option(arg.error_name());
 		}
 	}
+	if (!spray_dir.empty() && !do_spray)
+		throw inconsistent_option('o');
+	if (budget > 0 && !do_spray)
+		throw inconsistent_option('f');
 	const int num_op = argc - arg.operand();
-	if (do_spray) {
+	if (extract + diff + check > 1)
+		throw inconsistent_option(check ? "--check"sv : "--diff"sv);
+	if (check) {
+		if (lumpy || do_spray || !socket_path.empty())
+			throw inconsistent_option("--check"sv);
+		if (num_op != 1)
+			throw bad_operand_number(num_op);
+		run_check(argv[argc - 1]);
+	} else if (extract || diff) {
+		if (lumpy || do_spray || !socket_path.empty())
+			throw inconsistent_option(diff ? "--diff"sv : "x"sv);
+		if (num_op != 2)
+			throw bad_operand_number(num_op);
+		if (diff)
+			run_diff(argv[argc - 2], argv[argc - 1]);
+		else
+			run_extract(argv[argc - 2], argv[argc - 1]);
+	} else if (!socket_path.empty()) {
+		if (do_spray || watch || from_manifest || check_atlas())
+			throw inconsistent_option("--serve"sv);
+		if (num_op > 0)
+			throw bad_operand_number(num_op);
+		set_working_directory(std::move(project));
+		run_server(socket_path);
+	} else if (from_manifest) {
+		if (num_op != 1)
+			throw bad_operand_number(num_op);
+		set_working_directory(std::move(project));
+		run_manifest(argv[argc - 1]);
+	} else if (do_spray && !spray_dir.empty()) {
+		if (num_op < 1)
+			throw bad_operand_number(num_op);
+		run_sprays({argv + arg.operand(), argv + argc}, spray_dir,
+		           budget);
+	} else if (do_spray) {
 		if (num_op != 1)
 			throw bad_operand_number(num_op);
-		run_spray(argv[argc - 1]);
+		run_spray(argv[argc - 1], budget);
 	} else {
 		if (num_op > 1)
 			throw bad_operand_number(num_op);
 		const char* operand = argv[argc - 1];
-		if (num_op == 0 || std::strcmp(operand, "-") == 0) {
+		const bool from_stdin = num_op == 0
+		                        || std::strcmp(operand, "-") == 0;
+		if (from_stdin && watch) {
+			throw inconsistent_option('w');
+		} else if (from_stdin) {
 			script::run_from_stdin("out.wad");
+		} else if (watch) {
+			set_working_directory(std::move(project));
+			run_watch(operand, default_output(operand));
 		} else {
 			set_working_directory(std::move(project));
 			std::filesystem::path out = default_output(operand);
@@ -1,16 +1,25 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <exception>
 #include <filesystem>
 #include <iostream>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <variant>
 #include <vector>
 
+#include "cmd.h"
 #include "image.h"
+#include "queue.h"
 #include "script.h"
+#include "stats.h"
 #include "tokenizer.h"
+#include "trace.h"
 #include "stringutils.h"
 #include "wad.h"
 
@@ -18,6 +27,48 @@ using namespace std::literals;
 
 namespace {
 
+// $load or $loadbmp, along with the image once it is loaded
+struct load_op {
+	std::string path{};
+	image::load_type mode{};
+	image img{};
+};
+
+// Lump to grab from the last image loaded, and where it goes
+struct grab_op {
+	std::string name{};
+	std::size_t command = 0;
+	std::vector<image::argument_type> args{};
+	std::filesystem::path dest{};
+	bool singledest = false;
+	image::lump_type data{};
+};
+
+using script_op = std::variant<load_op, grab_op>;
+
+void report_wad(const wad::writer& w, std::ostream& log)
+{
+	log << w.size() << " lumps placed into ";
+	if (w.sharded())
+		log << w.shards() << " shards of ";
+	log << "WAD file: " << w.path() << std::endl;
+	if (!check_dedup())
+		return;
+	log << w.shared() << " lumps share the data of earlier ones, "
+	    << w.wasted() << " bytes are miptex copies under other names"
+	    << std::endl;
+}
+
+[[nodiscard]] wad::writer new_writer(const std::filesystem::path& dest,
+                                     bool shard = true)
+{
+	wad::writer w(dest, check_wad3());
+	w.set_dedup(check_dedup());
+	if (shard && check_shards())
+		w.set_shards(check_shard_bytes(), check_shard_lumps());
+	return w;
+}
+
 class lumpy_state {
 public:
 	lumpy_state(const std::filesystem::path&);
@@ -27,21 +78,18 @@ public:
 	lumpy_state(const std::filesystem::path& in,
 	            const std::filesystem::path& out);
 
-	~lumpy_state();
-	void run();
-
-private:
-	[[nodiscard]] std::optional<std::string> read_next_token();
-	[[nodiscard]] std::optional<std::string> include_and_read_next_token();
-	void run_directive();
-	void create_lump();
-	script::syntax_error syntax_error(std::string_view msg) const;
+	lumpy_state(std::string text, const std::filesystem::path& out,
+	            const script::bmp_loader& load, std::ostream& l);
 
-	[[nodiscard]]
-	bool has_path(const std::filesystem::path& p) const noexcept;
+	lumpy_state(const std::filesystem::path& in,
+	            const std::filesystem::path& out, script::recording& r);
 
-	template<class T> [[nodiscard]] T read_argument();
+	~lumpy_state();
+	void run();
+	void run_pipelined();
+	[[nodiscard]] std::vector<script::wad_file> release_wads();
 
+	// Argument readers of the lump types
 	[[nodiscard]] std::vector<std::variant<std::int32_t, float>>
 	read_colormap2_arguments();
 
@@ -52,11 +100,38 @@ private:
 	[[nodiscard]]
 	std::vector<std::variant<std::int32_t, float>> read_font_arguments();
 
+private:
+	[[nodiscard]] std::optional<std::string> read_next_token();
+	[[nodiscard]] std::optional<std::string> include_and_read_next_token();
+	[[nodiscard]] std::optional<script_op> next_op();
+	[[nodiscard]] std::optional<script_op> parse_directive();
+	[[nodiscard]] grab_op parse_lump();
+	void load_image(load_op& op) const;
+	void use_image(load_op& op);
+	void make_lump(grab_op& op);
+	void commit(grab_op& op);
+	[[nodiscard]] wad::writer& writer_for(const std::filesystem::path& p);
+	void write_wads();
+	script::syntax_error syntax_error(std::string_view msg) const;
+
+	[[nodiscard]]
+	bool has_path(const std::filesystem::path& p) const noexcept;
+
+	void check_readable(const std::filesystem::path& p) const;
+
+	template<class T> [[nodiscard]] T read_argument();
+
 	bool singledest = false;
+	bool served = false;
+	std::atomic<bool> parse_cancelled{false}; // by a later stage
 	unsigned int grabbed = 0;
+	std::ostream& log;
+	const script::bmp_loader* loader = nullptr;
+	script::recording* rec = nullptr;
 	image img{};
 	std::string directive{};
 	std::filesystem::path output_path;
+	std::vector<wad::writer> writers{};
 	std::vector<script_tokenizer> script_stack;
 };
 
@@ -70,41 +145,226 @@ struct command {
 			   const std::vector<image::argument_type>&);
 };
 
+constexpr std::array<command, 7> commands {
+	command { "palette"sv,
+	          &lumpy_state::read_integers<2>,
+	          &image::grab_palette }, // arguments optional
+
+	command { "colormap"sv,
+	          &lumpy_state::read_integers<2>,
+	          &image::grab_colormap },
+
+	command { "qpic"sv,
+	          &lumpy_state::read_integers<4>,
+	          &image::grab_qpic },
+
+	command { "miptex"sv,
+	          &lumpy_state::read_integers<4>,
+	          &image::grab_miptex },
+
+	command { "raw"sv,
+	          &lumpy_state::read_integers<4>,
+	          &image::grab_raw },
+
+	command { "colormap2"sv,
+	          &lumpy_state::read_colormap2_arguments,
+	          &image::grab_colormap2 },
+
+	command { "font"sv,
+	          &lumpy_state::read_font_arguments,
+	          &image::grab_font },
+};
+static_assert(wad::type_lumpy + commands.size() <= 127);
+
 lumpy_state::lumpy_state(const std::filesystem::path& out)
-	: output_path{out}
+	: log{std::cout}
+	, output_path{out}
 	, script_stack(1)
 {
-	std::cout << "Running Lumpy script from standard input" << std::endl;
+	log << "Running Lumpy script from standard input" << std::endl;
 }
 
 lumpy_state::lumpy_state(const std::filesystem::path& in,
                          const std::filesystem::path& out)
-	: output_path{out}
+	: log{std::cout}
+	, output_path{out}
 	, script_stack{}
 {
-	script_stack.emplace_back(in);
-	std::cout << "Running Lumpy script from file: " << in << std::endl;
+	script_stack.emplace_back(in, log);
+	log << "Running Lumpy script from file: " << in << std::endl;
+}
+
+// Served scripts hand their WAD files back instead of writing them
+lumpy_state::lumpy_state(std::string text, const std::filesystem::path& out,
+                         const script::bmp_loader& load, std::ostream& l)
+	: served{true}
+	, log{l}
+	, loader{&load}
+	, output_path{out}
+	, script_stack{}
+{
+	script_stack.emplace_back(std::move(text));
+}
+
+// Recorded scripts keep their lumps, grouped by the image they come from
+lumpy_state::lumpy_state(const std::filesystem::path& in,
+                         const std::filesystem::path& out,
+                         script::recording& r)
+	: lumpy_state(in, out)
+{
+	rec = &r;
+	rec->scripts.push_back(in);
+	rec->images.push_back({{}, false, {}});
 }
 
 lumpy_state::~lumpy_state()
 {
-	if (std::current_exception() != nullptr)
+	if (served || rec || std::current_exception() != nullptr)
 		return;
 	if (singledest) {
-		std::cout << grabbed << " lumps written separately"
-		          << std::endl;
+		log << grabbed << " lumps written separately" << std::endl;
 	} else {
-		wad::write();
-		std::cout << grabbed << " lumps placed into WAD file: "
-		          << output_path << std::endl;
+		write_wads();
 	}
 }
 
+std::vector<script::wad_file> lumpy_state::release_wads()
+{
+	std::vector<script::wad_file> wads;
+	wads.reserve(writers.size());
+	for (wad::writer& w : writers) {
+		report_wad(w, log);
+		wads.push_back({w.path(), w.release()});
+	}
+	writers.clear();
+	return wads;
+}
+
+wad::writer& lumpy_state::writer_for(const std::filesystem::path& dest)
+{
+	const auto p = [&dest](const wad::writer& w) {
+		return w.path() == dest;
+	};
+	const auto it = std::find_if(writers.begin(), writers.end(), p);
+	if (it != writers.end())
+		return *it;
+	// Served WAD files are answered whole
+	return writers.emplace_back(new_writer(dest, !served));
+}
+
+// Each $dest has its own writer, so the files can be written concurrently
+void lumpy_state::write_wads()
+{
+	const auto write = [this](std::size_t i) { writers[i].write(); };
+	for_each_job(writers.size(), write);
+	for (const wad::writer& w : writers)
+		report_wad(w, log);
+}
+
 void lumpy_state::run()
 {
-	while (std::optional<std::string> tok = read_next_token()) {
-		directive = *std::move(tok);
-		run_directive();
+	while (std::optional<script_op> op = next_op()) {
+		if (auto* const l = std::get_if<load_op>(&*op)) {
+			load_image(*l);
+			use_image(*l);
+		} else {
+			auto& g = std::get<grab_op>(*op);
+			make_lump(g);
+			commit(g);
+		}
+	}
+}
+
+/*
+ * Same as run(), with parsing, image loading, grabbing and committing lumps
+ * each on its own thread, so that the next image loads while the lumps of the
+ * current one are grabbed. At most two loaded images wait to be grabbed from.
+ * When a stage fails, the stages before it are cancelled and the stages after
+ * it finish what they were given, so the error reported is the one that comes
+ * first in the script, as with run(). The parser stops before its next token;
+ * one waiting for standard input stops once a line or the end of it comes.
+ */
+void lumpy_state::run_pipelined()
+{
+	constexpr std::size_t capacity = 64;
+	const auto weight = [](const script_op& op) -> std::size_t {
+		return std::holds_alternative<load_op>(op) ? capacity / 2 : 1;
+	};
+	bounded_queue<script_op> parsed(capacity), loaded(capacity);
+	bounded_queue<grab_op> made(capacity / 4);
+	std::array<std::exception_ptr, 4> errors;
+	// Cancel every stage before the one that stops
+	const auto cancel_loading = [&] {
+		parse_cancelled.store(true, std::memory_order_relaxed);
+		parsed.cancel();
+	};
+	const auto cancel_grabbing = [&] {
+		loaded.cancel();
+		cancel_loading();
+	};
+
+	std::thread parser([&] {
+		try {
+			while (std::optional<script_op> op = next_op()) {
+				if (!parsed.push(*std::move(op)))
+					break;
+			}
+		} catch (...) {
+			errors[0] = std::current_exception();
+		}
+		parsed.close();
+	});
+	std::thread image_loader([&] {
+		try {
+			while (std::optional<script_op> op = parsed.pop()) {
+				if (auto* const l = std::get_if<load_op>(&*op))
+					load_image(*l);
+				const std::size_t w = weight(*op);
+				if (!loaded.push(*std::move(op), w)) {
+					cancel_loading();
+					break;
+				}
+			}
+		} catch (...) {
+			errors[1] = std::current_exception();
+			cancel_loading();
+		}
+		loaded.close();
+	});
+	std::thread grabber([&] {
+		try {
+			while (std::optional<script_op> op = loaded.pop()) {
+				if (auto* const l = std::get_if<load_op>(&*op)) {
+					use_image(*l);
+					continue;
+				}
+				auto& g = std::get<grab_op>(*op);
+				make_lump(g);
+				if (!made.push(std::move(g))) {
+					cancel_grabbing();
+					break;
+				}
+			}
+		} catch (...) {
+			errors[2] = std::current_exception();
+			cancel_grabbing();
+		}
+		made.close();
+	});
+	try {
+		while (std::optional<grab_op> g = made.pop())
+			commit(*g);
+	} catch (...) {
+		errors[3] = std::current_exception();
+		made.cancel();
+		cancel_grabbing();
+	}
+	grabber.join();
+	image_loader.join();
+	parser.join();
+	for (auto it = errors.crbegin(); it != errors.crend(); ++it) {
+		if (*it)
+			std::rethrow_exception(*it);
 	}
 }
 
@@ -117,9 +377,12 @@ std::optional<std::string> lumpy_state::include_and_read_next_token()
 	if (script_stack.size() >= 24)
 		throw scr.make_syntax_error("Script stack is full"sv);
 	const std::filesystem::path path{t};
+	check_readable(path);
 	if (has_path(path))
 		throw scr.make_syntax_error("Cyclical script inclusions"sv);
-	script_stack.emplace_back(path);
+	script_stack.emplace_back(path, log);
+	if (rec)
+		rec->scripts.push_back(path);
 	return read_next_token();
 }
 
@@ -150,7 +413,39 @@ bool lumpy_state::has_path(const std::filesystem::path& p) const noexcept
 		!= script_stack.cend();
 }
 
-void lumpy_state::run_directive()
+/*
+ * Served scripts come from clients, which may only have files read from the
+ * project directory and below.
+ */
+void lumpy_state::check_readable(const std::filesystem::path& p) const
+{
+	if (!served)
+		return;
+	const auto up = [](const std::filesystem::path& c) {
+		return c == "..";
+	};
+	if (p.has_root_path() || std::any_of(p.begin(), p.end(), up))
+		throw syntax_error("Served scripts may not read outside the "
+		                   "project directory"sv);
+}
+
+std::optional<script_op> lumpy_state::next_op()
+{
+	const stats::timer timer(stats::phase::parse);
+	while (!parse_cancelled.load(std::memory_order_relaxed)) {
+		std::optional<std::string> tok = read_next_token();
+		if (!tok)
+			break;
+		directive = *std::move(tok);
+		const trace::span span("directive", directive);
+		if (std::optional<script_op> op = parse_directive())
+			return op;
+	}
+	return std::nullopt;
+}
+
+// Gives the step a directive stands for, if it is not just a setting
+std::optional<script_op> lumpy_state::parse_directive()
 {
 	using namespace std::literals;
 
@@ -165,58 +460,34 @@ void lumpy_state::run_directive()
 		std::optional<std::string> tok = read_next_token();
 		if (!tok)
 			throw syntax_error("Missing file path after $load"sv);
-		img = image(*tok, image::load_type::lbm);
+		check_readable(*tok);
+		return load_op{*std::move(tok), image::load_type::lbm};
 	} else if (util::compare_nocase(directive, "$loadbmp"sv)) {
 		std::optional<std::string> tok = read_next_token();
 		if (!tok)
 			throw syntax_error("Missing path after $loadbmp"sv);
-		img = image(*tok, image::load_type::bmp);
+		check_readable(*tok);
+		return load_op{*std::move(tok), image::load_type::bmp};
 	} else if (util::compare_nocase(directive, "$singledest"sv)) {
 		std::optional<std::string> tok = read_next_token();
 		if (!tok)
 			throw syntax_error("Missing path after $singledest"sv);
+		if (served)
+			throw syntax_error("$singledest needs a file system"sv);
+		if (rec)
+			throw syntax_error("$singledest lumps are not kept"sv);
 		output_path = *std::move(tok);
 		singledest = true;
 	} else {
-		create_lump();
+		return parse_lump();
 	}
+	return std::nullopt;
 }
 
-void lumpy_state::create_lump()
+grab_op lumpy_state::parse_lump()
 {
 	using namespace std::literals;
 
-	static constexpr std::array<command, 7> commands {
-		command { "palette"sv,
-		          &lumpy_state::read_integers<2>,
-		          &image::grab_palette }, // arguments optional
-
-		command { "colormap"sv,
-		          &lumpy_state::read_integers<2>,
-		          &image::grab_colormap },
-
-		command { "qpic"sv,
-		          &lumpy_state::read_integers<4>,
-		          &image::grab_qpic },
-
-		command { "miptex"sv,
-		          &lumpy_state::read_integers<4>,
-		          &image::grab_miptex },
-
-		command { "raw"sv,
-		          &lumpy_state::read_integers<4>,
-		          &image::grab_raw },
-
-		command { "colormap2"sv,
-		          &lumpy_state::read_colormap2_arguments,
-		          &image::grab_colormap2 },
-
-		command { "font"sv,
-		          &lumpy_state::read_font_arguments,
-		          &image::grab_font },
-	};
-	static_assert(wad::type_lumpy + commands.size() <= 127);
-
 	static constexpr auto find_type = [](std::string_view token) {
 		auto p = [token](const command& c){ return token == c.name; };
 		return std::find_if(commands.cbegin(), commands.cend(), p);
@@ -228,25 +499,64 @@ void lumpy_state::create_lump()
 	const auto it = find_type(*token);
 	if (it == commands.cend())
 		throw syntax_error("Unknown lump type: "s + *token);
-	image::lump_type data;
+	const auto d = static_cast<std::size_t>(it - commands.cbegin());
+	return {directive, d, (this->*it->read_args)(), output_path,
+	        singledest};
+}
+
+void lumpy_state::load_image(load_op& op) const
+{
+	const trace::span span("load", op.path);
+	if (op.mode == image::load_type::bmp && loader)
+		op.img = (*loader)(op.path);
+	else if (op.mode == image::load_type::bmp && check_atlas())
+		op.img = image(op.path, image::load_type::atlas);
+	else
+		op.img = image(op.path, op.mode);
+}
+
+void lumpy_state::use_image(load_op& op)
+{
+	img = std::move(op.img);
+	if (rec) {
+		const bool lbm = op.mode == image::load_type::lbm;
+		rec->images.push_back({std::move(op.path), lbm, {}});
+	}
+}
+
+void lumpy_state::make_lump(grab_op& op)
+{
 	try {
-		data = (img.*it->function)(directive,
-		                           (this->*it->read_args)());
+		const trace::span span("grab", op.name);
+		const stats::timer timer(stats::phase::grab);
+		op.data = (img.*commands[op.command].function)(op.name,
+		                                               op.args);
+		stats::add_lump(op.name, timer.elapsed(), op.data.size());
 		++grabbed;
 	} catch (const std::exception& e) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
-		  << ": Could not create lump '" << directive << "'\n"
+		  << ": Could not create lump '" << op.name << "'\n"
 		  << e.what();
 		throw std::runtime_error(s.str());
 	}
-	const wad::lump l(directive, data.data(), data.size());
-	if (singledest) {
-		l.write(output_path);
+}
+
+void lumpy_state::commit(grab_op& op)
+{
+	const trace::span span("commit", op.name);
+	const wad::lump l(op.name, op.data.data(), op.data.size());
+	if (rec) {
+		rec->images.back().lumps.push_back({
+			std::move(op.dest), std::move(op.name), op.command,
+			std::move(op.args), std::move(op.data)
+		});
+	} else if (op.singledest) {
+		l.write(op.dest);
 	} else {
-		const auto d = it - commands.cbegin();
-		const char type = static_cast<char>(wad::type_lumpy + d);
-		wad::add(output_path, l, type);
+		const char type = static_cast<char>(wad::type_lumpy
+		                                    + op.command);
+		writer_for(op.dest).add(l, type);
 	}
 }
 
@@ -320,7 +630,69 @@ void script::run_from_path(const std::filesystem::path& in,
 	lumpy_state(in, out).run();
 }
 
+script::recording script::record_from_path(const std::filesystem::path& in,
+                                           const std::filesystem::path& out)
+{
+	recording r;
+	lumpy_state(in, out, r).run();
+	return r;
+}
+
+void script::regrab(image_grabs& g)
+{
+	image img;
+	if (!g.source.empty()) {
+		const auto mode = g.lbm ? image::load_type::lbm :
+		                          image::load_type::bmp;
+		img = image(g.source, mode);
+	}
+	std::vector<image::lump_type> data;
+	data.reserve(g.lumps.size());
+	for (const grab& l : g.lumps) {
+		const auto f = commands[l.command].function;
+		data.push_back((img.*f)(l.name, l.args));
+	}
+	for (std::size_t i = 0; i < data.size(); ++i)
+		g.lumps[i].data = std::move(data[i]);
+}
+
+void script::write_recording(const recording& rec,
+                             const std::vector<std::filesystem::path>& dests)
+{
+	std::vector<wad::writer> writers;
+	for (const image_grabs& g : rec.images) {
+		for (const grab& l : g.lumps) {
+			if (std::find(dests.cbegin(), dests.cend(), l.dest)
+			    == dests.cend())
+				continue;
+			const auto p = [&l](const wad::writer& w) {
+				return w.path() == l.dest;
+			};
+			auto it = std::find_if(writers.begin(), writers.end(),
+			                       p);
+			if (it == writers.end()) {
+				writers.push_back(new_writer(l.dest));
+				it = writers.end() - 1;
+			}
+			const char type = static_cast<char>(wad::type_lumpy
+			                                    + l.command);
+			it->add(l.name, l.data.data(), l.data.size(), type);
+		}
+	}
+	const auto write = [&writers](std::size_t i) { writers[i].write(); };
+	for_each_job(writers.size(), write);
+}
+
 void script::run_from_stdin(const std::filesystem::path& out)
 {
-	lumpy_state(out).run();
+	lumpy_state(out).run_pipelined();
+}
+
+std::vector<script::wad_file>
+script::run_from_memory(std::string text, const std::filesystem::path& out,
+                        const bmp_loader& load, std::ostream& log)
+{
+	lumpy_state state(std::move(text), out, load, log);
+	state.run();
+	return state.release_wads();
 }
@@ -1,8 +1,17 @@
 #ifndef SCRIPT_H
 #define SCRIPT_H
 
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <iosfwd>
 #include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+class image;
 
 namespace script {
 
@@ -15,6 +24,53 @@ public:
 void run_from_path(const std::filesystem::path&, const std::filesystem::path&);
 void run_from_stdin(const std::filesystem::path& out);
 
+// WAD file made by a script without being written
+struct wad_file {
+	std::filesystem::path path;
+	std::vector<std::byte> data;
+};
+
+// Gives the image a $loadbmp directive names
+using bmp_loader = std::function<image(const std::filesystem::path&)>;
+
+// Runs a script held in memory, logging what standard output would show
+[[nodiscard]] std::vector<wad_file>
+run_from_memory(std::string text, const std::filesystem::path& out,
+                const bmp_loader& load, std::ostream& log);
+
+// Lump of a recorded script, with what it takes to grab it again
+struct grab {
+	std::filesystem::path dest;
+	std::string name;
+	std::size_t command;
+	std::vector<std::variant<std::int32_t, float>> args;
+	std::vector<std::byte> data;
+};
+
+// Lumps grabbed from one loaded image, which depend on nothing else
+struct image_grabs {
+	std::filesystem::path source; // empty before any image is loaded
+	bool lbm;
+	std::vector<grab> lumps;
+};
+
+struct recording {
+	std::vector<std::filesystem::path> scripts{};
+	std::vector<image_grabs> images{};
+};
+
+// Runs a script, keeping its lumps instead of writing them
+[[nodiscard]] recording record_from_path(const std::filesystem::path& in,
+                                         const std::filesystem::path& out);
+
+// Loads the image again and grabs its lumps, leaving them as they were if
+// anything fails
+void regrab(image_grabs& g);
+
+// Writes the recorded WAD files that are among dests, atomically
+void write_recording(const recording& rec,
+                     const std::vector<std::filesystem::path>& dests);
+
 }
 
 #endif
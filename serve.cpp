@@ -0,0 +1,448 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "image.h"
+#include "pool.h"
+#include "script.h"
+#include "serve.h"
+#include "spray.h"
+
+/*
+ * Protocol: a request is a header line followed by as many bytes as it says.
+ *
+ *     script SIZE                  Lumpy script text
+ *     spray SIZE NAME [BUDGET]     BMP file, transparent if NAME starts with {
+ *
+ * A success is answered with "ok COUNT" and COUNT WAD files, each one being a
+ * "SIZE PATH" line followed by its bytes. A failure is answered with
+ * "error SIZE" followed by the message. Connections take requests until the
+ * client closes them, until a header cannot be understood, or until a read or
+ * write waits longer than the idle limit.
+ */
+
+using namespace std::literals;
+
+namespace {
+
+constexpr std::size_t max_header = 1024;
+constexpr std::size_t max_payload = std::size_t{1} << 28;
+constexpr std::size_t max_cached_pixels = std::size_t{1} << 28;
+constexpr auto idle_limit = 10s;
+
+[[nodiscard]] std::system_error
+system_error(const char* func, unsigned int line, std::string_view what)
+{
+	const int e = errno;
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": " << what;
+	return std::system_error(e, std::generic_category(), s.str());
+}
+
+class protocol_error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/*
+ * Decoded $loadbmp images, reused while their file stays the same. Once they
+ * hold more pixels than the limit, the least recently used are dropped.
+ */
+class image_cache {
+public:
+	[[nodiscard]] image load(const std::filesystem::path& p);
+
+private:
+	struct entry {
+		std::filesystem::file_time_type time;
+		std::uintmax_t size;
+		std::shared_ptr<const image> img;
+		std::size_t pixels;
+		std::list<std::filesystem::path>::iterator use;
+	};
+
+	void insert(const std::filesystem::path& p, entry e);
+
+	std::mutex mutex{};
+	std::map<std::filesystem::path, entry> entries{};
+	std::list<std::filesystem::path> uses{}; // most recent first
+	std::size_t pixels = 0;
+};
+
+image image_cache::load(const std::filesystem::path& p)
+{
+	const std::filesystem::path exp = expand(p);
+	const auto time = std::filesystem::last_write_time(exp);
+	const auto size = std::filesystem::file_size(exp);
+	{
+		const std::lock_guard lock(mutex);
+		const auto it = entries.find(exp);
+		if (it != entries.end() && it->second.time == time
+		    && it->second.size == size) {
+			uses.splice(uses.begin(), uses, it->second.use);
+			return it->second.img->clone();
+		}
+	}
+	const auto img = std::make_shared<const image>(p,
+	                                               image::load_type::bmp);
+	const auto [w, h] = img->dimensions();
+	const std::lock_guard lock(mutex);
+	insert(exp, {time, size, img,
+	             static_cast<std::size_t>(w) * static_cast<std::size_t>(h),
+	             {}});
+	return img->clone();
+}
+
+// Replaces any older entry, and evicts others but the new one past the limit
+void image_cache::insert(const std::filesystem::path& p, entry e)
+{
+	if (const auto it = entries.find(p); it != entries.end()) {
+		pixels -= it->second.pixels;
+		uses.erase(it->second.use);
+		entries.erase(it);
+	}
+	uses.push_front(p);
+	e.use = uses.begin();
+	pixels += e.pixels;
+	entries.emplace(p, std::move(e));
+	while (pixels > max_cached_pixels && uses.size() > 1) {
+		const auto it = entries.find(uses.back());
+		pixels -= it->second.pixels;
+		entries.erase(it);
+		uses.pop_back();
+	}
+}
+
+// Buffered reads and whole writes on a connected socket
+class connection {
+public:
+	explicit connection(int f) noexcept : fd{f} {}
+	connection(const connection&) = delete;
+	connection& operator=(const connection&) = delete;
+	~connection() noexcept { ::close(fd); }
+
+	// Fails reads and writes that wait longer than the idle limit
+	void limit_idle();
+
+	[[nodiscard]] std::optional<std::string> read_line();
+	void read(std::byte* out, std::size_t n);
+	void write(const void* p, std::size_t n);
+	void write(std::string_view s) { write(s.data(), s.size()); }
+
+private:
+	[[nodiscard]] bool fill();
+
+	const int fd;
+	std::array<char, 4096> buffer{};
+	std::size_t begin = 0;
+	std::size_t end = 0;
+};
+
+void connection::limit_idle()
+{
+	const timeval t{idle_limit.count(), 0};
+	if (::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof t) < 0
+	    || ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof t) < 0)
+		throw system_error(__func__, __LINE__,
+		                   "Could not limit idle time"sv);
+}
+
+// Reads more bytes, or none once the client closed or went idle
+bool connection::fill()
+{
+	ssize_t r;
+	do
+		r = ::read(fd, buffer.data(), buffer.size());
+	while (r < 0 && errno == EINTR);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		r = 0;
+	else if (r < 0)
+		throw system_error(__func__, __LINE__, "Could not read"sv);
+	begin = 0;
+	end = static_cast<std::size_t>(r);
+	return r > 0;
+}
+
+std::optional<std::string> connection::read_line()
+{
+	std::string line;
+	for (;;) {
+		if (begin == end && !fill()) {
+			if (line.empty())
+				return std::nullopt;
+			throw protocol_error("Request header ends early");
+		}
+		const char* const first = buffer.data() + begin;
+		const char* const last = buffer.data() + end;
+		const char* const nl = std::find(first, last, '\n');
+		line.append(first, nl);
+		begin = static_cast<std::size_t>(nl - buffer.data());
+		if (line.size() > max_header)
+			throw protocol_error("Request header is too long");
+		if (nl != last) {
+			++begin;
+			return line;
+		}
+	}
+}
+
+void connection::read(std::byte* out, std::size_t n)
+{
+	while (n > 0) {
+		if (begin == end && !fill())
+			throw protocol_error("Request payload ends early");
+		const std::size_t k = std::min(n, end - begin);
+		std::memcpy(out, buffer.data() + begin, k);
+		begin += k;
+		out += k;
+		n -= k;
+	}
+}
+
+void connection::write(const void* p, std::size_t n)
+{
+	auto ptr = static_cast<const char*>(p);
+	while (n > 0) {
+		const ssize_t r = ::send(fd, ptr, n, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			throw system_error(__func__, __LINE__,
+			                   "Could not send answer"sv);
+		ptr += r;
+		n -= static_cast<std::size_t>(r);
+	}
+}
+
+void send_error(connection& c, std::string_view msg)
+{
+	std::ostringstream s;
+	s << "error "sv << msg.size() << '\n' << msg;
+	c.write(s.str());
+}
+
+void send_wads(connection& c, const std::vector<script::wad_file>& wads)
+{
+	std::ostringstream s;
+	s << "ok "sv << wads.size() << '\n';
+	c.write(s.str());
+	for (const script::wad_file& w : wads) {
+		s.str({});
+		s << w.data.size() << ' ' << w.path.string() << '\n';
+		c.write(s.str());
+		c.write(w.data.data(), w.data.size());
+	}
+}
+
+[[nodiscard]] std::vector<script::wad_file>
+run_request(std::istringstream& header, const std::string& kind,
+            std::vector<std::byte> payload, image_cache& cache)
+{
+	std::ostringstream log;
+	if (kind == "script"sv) {
+		const script::bmp_loader load = [&cache](const auto& p) {
+			return cache.load(p);
+		};
+		std::string text(reinterpret_cast<const char*>(payload.data()),
+		                 payload.size());
+		return script::run_from_memory(std::move(text), "out.wad"sv,
+		                               load, log);
+	}
+	std::string name;
+	std::int32_t budget = 0;
+	if (!(header >> name))
+		throw std::invalid_argument("Spray request has no name");
+	if (!(header >> budget) && !header.eof())
+		throw std::invalid_argument("Spray budget is not a number");
+	if (budget != 0 && budget < 256)
+		throw std::invalid_argument("Spray budget is under 256 pixels");
+	image img(payload.data(), payload.size(), name.front() == '{');
+	std::vector<script::wad_file> wads;
+	wads.push_back({"tempdecal.wad"sv,
+	                make_spray_wad(std::move(img), budget, log)});
+	return wads;
+}
+
+// Answers one request, telling whether the connection can take another
+[[nodiscard]] bool serve_request(connection& c, image_cache& cache,
+                                 std::mutex& log_mutex)
+{
+	const std::optional<std::string> line = c.read_line();
+	if (!line)
+		return false;
+	std::istringstream header(*line);
+	std::string kind;
+	std::size_t size = 0;
+	header >> kind >> size;
+	if (!header || (kind != "script"sv && kind != "spray"sv)) {
+		send_error(c, "Unknown request: "s + *line);
+		return false;
+	}
+	if (size > max_payload) {
+		send_error(c, "Request payload is too large"sv);
+		return false;
+	}
+	std::vector<std::byte> payload(size);
+	c.read(payload.data(), size);
+	try {
+		const auto wads = run_request(header, kind, std::move(payload),
+		                              cache);
+		send_wads(c, wads);
+		const std::lock_guard lock(log_mutex);
+		std::cout << "Served "sv << kind << " request with "sv
+		          << wads.size() << " WAD files"sv << std::endl;
+	} catch (const std::exception& e) {
+		send_error(c, e.what());
+		const std::lock_guard lock(log_mutex);
+		std::cout << "Failed "sv << kind << " request:\n"sv << e.what()
+		          << std::endl;
+	}
+	return true;
+}
+
+/*
+ * Failures to accept, such as running out of descriptors for a while, are
+ * logged without stopping the handler, which waits a little before retrying.
+ */
+void accept_failed(std::mutex& log_mutex)
+{
+	const auto e = system_error(__func__, __LINE__, "Could not accept"sv);
+	{
+		const std::lock_guard lock(log_mutex);
+		std::cout << e.what() << std::endl;
+	}
+	std::this_thread::sleep_for(100ms);
+}
+
+char bound_path[sizeof(sockaddr_un::sun_path)];
+
+extern "C" void remove_socket(int sig)
+{
+	::unlink(bound_path);
+	std::signal(sig, SIG_DFL);
+	std::raise(sig);
+}
+
+/*
+ * Removes a socket left by a server that was not stopped by a signal, which
+ * refuses connections, and tells whether it did. Only one that refuses is
+ * removed, since a server may still be listening on any other.
+ */
+[[nodiscard]] bool remove_stale(const sockaddr* addr, socklen_t size)
+{
+	const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw system_error(__func__, __LINE__,
+		                   "Could not create socket"sv);
+	const bool refused = ::connect(fd, addr, size) < 0
+	                     && errno == ECONNREFUSED;
+	::close(fd);
+	if (refused)
+		::unlink(reinterpret_cast<const sockaddr_un*>(addr)->sun_path);
+	return refused;
+}
+
+[[nodiscard]] int listen_on(const std::filesystem::path& path)
+{
+	const std::string& name = path.native();
+	if (name.size() >= sizeof bound_path) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Socket path is too long: " << path;
+		throw std::invalid_argument(s.str());
+	}
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	std::copy(name.begin(), name.end(), addr.sun_path);
+	const auto a = reinterpret_cast<const sockaddr*>(&addr);
+	if (std::filesystem::is_socket(path)
+	    && !remove_stale(a, sizeof addr)) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Socket " << path << " is in use by another server";
+		throw std::runtime_error(s.str());
+	}
+	const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw system_error(__func__, __LINE__,
+		                   "Could not create socket"sv);
+	if (::bind(fd, a, sizeof addr) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+		const auto e = system_error(__func__, __LINE__,
+		                            "Could not listen on socket"sv);
+		::close(fd);
+		throw e;
+	}
+	std::copy(name.begin(), name.end(), bound_path);
+	std::signal(SIGINT, remove_socket);
+	std::signal(SIGTERM, remove_socket);
+	return fd;
+}
+
+}
+
+/*
+ * Each handler accepts connections and serves them on its own, while images
+ * stay decoded in the shared cache. Miptex lumps are still banded on the
+ * pool given with -j, which every handler may use at once.
+ */
+void run_server(const std::filesystem::path& socket_path)
+{
+	const int fd = listen_on(socket_path);
+	const worker_pool* const jobs = job_pool();
+	const unsigned int n = jobs ? jobs->jobs() :
+	                       std::max(std::thread::hardware_concurrency(), 1u);
+	image_cache cache;
+	std::mutex log_mutex;
+	std::cout << "Serving "sv << n << " connections at once on "sv
+	          << socket_path << std::endl;
+	const auto handle = [&](std::size_t) {
+		for (;;) {
+			const int c = ::accept4(fd, nullptr, nullptr,
+			                        SOCK_CLOEXEC);
+			if (c < 0 && (errno == EINTR || errno == ECONNABORTED))
+				continue;
+			if (c < 0) {
+				accept_failed(log_mutex);
+				continue;
+			}
+			connection conn(c);
+			try {
+				conn.limit_idle();
+				while (serve_request(conn, cache, log_mutex))
+					;
+			} catch (const std::exception& e) {
+				const std::lock_guard lock(log_mutex);
+				std::cout << "Dropped connection:\n"sv
+				          << e.what() << std::endl;
+			}
+		}
+	};
+	worker_pool handlers(n);
+	handlers.for_each(n, handle);
+}
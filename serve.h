@@ -0,0 +1,9 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <filesystem>
+
+// Answers script and spray requests on a Unix domain socket until killed
+void run_server(const std::filesystem::path& socket_path);
+
+#endif
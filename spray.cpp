@@ -1,39 +1,160 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <filesystem>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
 #include <string_view>
+#include <utility>
+#include <vector>
 
+#include "cmd.h"
 #include "image.h"
 #include "wad.h"
 
-/*
- * NOTE: Maximum supported dimensions are taken from this chart:
- * https://the303.org/tutorials/goldsrclogoimages/goldsrcchart.png
- */
-
 using namespace std::literals;
 
-static void warn_dimensions(const image& img)
+static void warn_dimensions(const image& img, std::ostream& log)
 {
 	const auto [width, height] = img.dimensions();
 	const std::int32_t surface = width * height;
-	if (surface > 14336) {
-		std::cout << "Warning: image has "sv << surface
-		          << " pixels which is too much even for Sven Co-op"sv
-		          << std::endl;
-	} else if (surface > 12288) {
-		std::cout << "Warning: image has "sv << surface
-		          << " pixels which is valid only for Sven Co-op"sv
-		          << std::endl;
+	const std::string_view problem = wad::spray_problem(surface);
+	if (!problem.empty()) {
+		log << "Warning: image has "sv << surface
+		    << " pixels which is "sv << problem << std::endl;
 	}
 }
 
-void run_spray(const std::filesystem::path& in)
+[[nodiscard]] static constexpr std::int32_t round16(std::int32_t n) noexcept
 {
-	static constexpr char type = wad::type_lumpy + 3;
-	image img(in, image::load_type::bmp);
-	warn_dimensions(img);
+	return std::max(n / 16 * 16, std::int32_t{16});
+}
+
+/*
+ * Largest multiples of 16 no bigger than the image that fit within the budget
+ * and keep its aspect ratio, with each side rounded to the nearest multiple.
+ */
+[[nodiscard]] static std::pair<std::int32_t, std::int32_t>
+fit_dimensions(std::int32_t width, std::int32_t height, std::int32_t budget)
+{
+	std::pair<std::int32_t, std::int32_t> best{16, 16};
+	const double aspect = static_cast<double>(height) / width;
+	for (std::int32_t w = 16; w <= round16(width); w += 16) {
+		const auto ideal = static_cast<std::int32_t>(aspect * w + 8.);
+		const std::int32_t h = std::min(round16(ideal), round16(height));
+		if (w * h <= budget && w * h > best.first * best.second)
+			best = {w, h};
+	}
+	return best;
+}
+
+static void fit_image(image& img, std::int32_t budget, std::ostream& log)
+{
+	const auto [width, height] = img.dimensions();
+	const auto [w, h] = fit_dimensions(width, height, budget);
+	if (w == width && h == height)
+		return;
+	log << "Resampling image from "sv << width << 'x' << height
+	    << " to "sv << w << 'x' << h << std::endl;
+	img.resample(w, h);
+}
+
+static void add_spray(wad::writer& w, image& img, std::int32_t budget,
+                      std::ostream& log)
+{
+	if (budget > 0)
+		fit_image(img, budget, log);
+	warn_dimensions(img, log);
 	const auto lump_data = img.grab_miptex("{LOGO"sv, {-1, -1, -1, -1});
 	const wad::lump lump("{LOGO"sv, lump_data.data(), lump_data.size());
-	wad::add("tempdecal.wad"sv, lump, type);
-	wad::write();
+	w.add(lump, wad::type_miptex);
+}
+
+static void make_spray(const std::filesystem::path& in,
+                       const std::filesystem::path& out, std::int32_t budget,
+                       std::ostream& log)
+{
+	image img(in, image::load_type::bmp);
+	wad::writer w(out, true);
+	add_spray(w, img, budget, log);
+	w.write();
+}
+
+std::vector<std::byte> make_spray_wad(image img, std::int32_t budget,
+                                      std::ostream& log)
+{
+	wad::writer w("tempdecal.wad"sv, true);
+	add_spray(w, img, budget, log);
+	return w.release();
+}
+
+void run_spray(const std::filesystem::path& in, std::int32_t budget)
+{
+	make_spray(in, "tempdecal.wad"sv, budget, std::cout);
+}
+
+/*
+ * Images of the same name in different directories would make sprays written
+ * to the same file at once, so they are rejected before anything is made.
+ */
+static std::vector<std::filesystem::path>
+output_paths(const std::vector<std::filesystem::path>& in,
+             const std::filesystem::path& dir)
+{
+	std::vector<std::filesystem::path> out;
+	out.reserve(in.size());
+	std::map<std::filesystem::path, std::size_t> seen;
+	for (std::size_t i = 0; i < in.size(); ++i) {
+		out.push_back(dir / in[i].filename().replace_extension("wad"));
+		const auto [it, added] = seen.emplace(out.back(), i);
+		if (added)
+			continue;
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Sprays from " << in[it->second] << " and " << in[i]
+		  << " would both be written to " << out.back();
+		throw std::invalid_argument(s.str());
+	}
+	return out;
+}
+
+/*
+ * Every spray gets its own image and WAD writer, so the only thing workers
+ * share is the standard output, where each spray's log goes in one piece.
+ */
+void run_sprays(const std::vector<std::filesystem::path>& in,
+                const std::filesystem::path& dir, std::int32_t budget)
+{
+	const auto out = output_paths(in, dir);
+	std::mutex log_mutex;
+	std::size_t failures = 0;
+	const auto run = [&](std::size_t i) {
+		std::ostringstream log;
+		bool failed = false;
+		try {
+			make_spray(in[i], out[i], budget, log);
+			log << "Spray written: "sv << out[i] << '\n';
+		} catch (const std::exception& e) {
+			log << "Could not make spray from "sv << in[i] << ":\n"sv
+			    << e.what() << '\n';
+			failed = true;
+		}
+		const std::lock_guard lock(log_mutex);
+		std::cout << log.str() << std::flush;
+		failures += failed;
+	};
+
+	std::filesystem::create_directories(dir);
+	for_each_job(in.size(), run);
+	if (failures > 0) {
+		std::ostringstream s;
+		s << failures << " out of "sv << in.size()
+		  << " sprays could not be made"sv;
+		throw std::runtime_error(s.str());
+	}
 }
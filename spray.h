@@ -1,8 +1,21 @@
 #ifndef SPRAY_H
 #define SPRAY_H
 
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <iosfwd>
+#include <vector>
 
-void run_spray(const std::filesystem::path& in);
+class image;
+
+// A positive budget resamples images down to at most that many pixels
+void run_spray(const std::filesystem::path& in, std::int32_t budget);
+void run_sprays(const std::vector<std::filesystem::path>& in,
+                const std::filesystem::path& dir, std::int32_t budget);
+
+// Bytes of the WAD file a spray of the image would be written to
+[[nodiscard]] std::vector<std::byte>
+make_spray_wad(image img, std::int32_t budget, std::ostream& log);
 
 #endif
@@ -0,0 +1,349 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <locale>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "stats.h"
+
+using namespace std::literals;
+
+namespace {
+
+template<class E>
+using table = std::array<std::atomic<std::uint64_t>,
+                         static_cast<std::size_t>(E::count)>;
+
+// Heap use of the lump grabbed on a thread, in bytes
+struct lump_memory {
+	std::uint64_t allocations;
+	std::uint64_t bytes;
+	std::int64_t live; // negative after freeing blocks made before
+	std::int64_t peak;
+};
+
+struct lump_time {
+	std::string name;
+	std::chrono::nanoseconds time;
+	std::size_t size;
+	lump_memory memory;
+};
+
+// The last slot counts allocations made outside of any phase
+using phase_slots = std::array<std::atomic<std::uint64_t>,
+                               static_cast<std::size_t>(stats::phase::count)
+                               + 1>;
+
+// Only the worst lumps are listed by heap use
+constexpr std::size_t worst_lumps = 10;
+
+constexpr std::string_view counter_names[] = {
+	"average_pixels_calls"sv, "color_cache_hits"sv, "texels_reduced"sv,
+	"colors_added"sv, "bytes_read"sv, "bytes_written"sv
+};
+
+constexpr std::string_view peak_names[] = {
+	"image_bytes"sv, "lump_bytes"sv, "wad_bytes"sv
+};
+
+constexpr std::string_view phase_names[] = {
+	"parse"sv, "load"sv, "grab"sv, "mipmap"sv, "write"sv, "other"sv
+};
+
+table<stats::counter> counters;
+table<stats::peak> peaks;
+table<stats::phase> phase_times;
+table<stats::phase> phase_counts;
+std::atomic<bool> active{false};
+std::chrono::steady_clock::time_point enabled_at{};
+std::mutex lumps_mutex;
+std::vector<lump_time> lumps;
+
+std::atomic<bool> tracking{false};
+std::atomic<std::int64_t> heap_live{0};
+std::atomic<std::uint64_t> heap_peak{0};
+phase_slots phase_allocations;
+phase_slots phase_bytes;
+phase_slots phase_heap_peaks;
+phase_slots phase_rss; // KiB, sampled as the outermost phases end
+thread_local stats::phase current_phase = stats::phase::count;
+thread_local lump_memory lump_usage{};
+
+template<class E>
+[[nodiscard]] constexpr std::size_t index(E e) noexcept
+{
+	return static_cast<std::size_t>(e);
+}
+
+void raise_to(std::atomic<std::uint64_t>& v, const std::uint64_t n) noexcept
+{
+	std::uint64_t old = v.load(std::memory_order_relaxed);
+	while (old < n && !v.compare_exchange_weak(old, n,
+	                                           std::memory_order_relaxed))
+		;
+}
+
+// Resident set size and its high-water mark in KiB
+struct rss_sample {
+	std::uint64_t rss = 0;
+	std::uint64_t hwm = 0;
+};
+
+[[nodiscard]] std::uint64_t status_field(std::string_view status,
+                                         std::string_view key) noexcept
+{
+	const std::size_t at = status.find(key);
+	if (at == std::string_view::npos)
+		return 0;
+	status.remove_prefix(at + key.size());
+	const std::size_t digit = status.find_first_not_of(" \t"sv);
+	if (digit == std::string_view::npos)
+		return 0;
+	std::uint64_t kib = 0;
+	std::from_chars(status.data() + digit, status.data() + status.size(),
+	                kib);
+	return kib;
+}
+
+// Reads /proc/self/status without allocating, so as not to be counted
+[[nodiscard]] rss_sample sample_rss() noexcept
+{
+	char buf[4096];
+	const int fd = ::open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return {};
+	std::size_t size = 0;
+	ssize_t n;
+	while (size < sizeof buf
+	       && (n = ::read(fd, buf + size, sizeof buf - size)) > 0)
+		size += static_cast<std::size_t>(n);
+	::close(fd);
+	const std::string_view status(buf, size);
+	return {status_field(status, "VmRSS:"sv),
+	        status_field(status, "VmHWM:"sv)};
+}
+
+[[nodiscard]] double seconds(std::chrono::nanoseconds t) noexcept
+{
+	return std::chrono::duration<double>(t).count();
+}
+
+}
+
+void stats::add(const stats::counter c, const std::uint64_t n) noexcept
+{
+	counters[index(c)].fetch_add(n, std::memory_order_relaxed);
+}
+
+std::uint64_t stats::get(const stats::counter c) noexcept
+{
+	return counters[index(c)].load(std::memory_order_relaxed);
+}
+
+void stats::enable() noexcept
+{
+	enabled_at = std::chrono::steady_clock::now();
+	active.store(true, std::memory_order_relaxed);
+}
+
+bool stats::enabled() noexcept
+{
+	return active.load(std::memory_order_relaxed);
+}
+
+void stats::raise(const stats::peak p, const std::uint64_t n) noexcept
+{
+	if (enabled())
+		raise_to(peaks[index(p)], n);
+}
+
+void stats::add_lump(std::string_view name, std::chrono::nanoseconds t,
+                     std::size_t size)
+{
+	if (!enabled())
+		return;
+	const std::lock_guard lock(lumps_mutex);
+	lumps.push_back({std::string(name), t, size, lump_usage});
+}
+
+void stats::track_memory() noexcept
+{
+	enable();
+	tracking.store(true, std::memory_order_relaxed);
+}
+
+bool stats::tracking_memory() noexcept
+{
+	return tracking.load(std::memory_order_relaxed);
+}
+
+void stats::allocated(const std::size_t n) noexcept
+{
+	const auto size = static_cast<std::int64_t>(n);
+	const std::int64_t live = heap_live.fetch_add(
+		size, std::memory_order_relaxed) + size;
+	const auto i = index(current_phase);
+	phase_allocations[i].fetch_add(1, std::memory_order_relaxed);
+	phase_bytes[i].fetch_add(n, std::memory_order_relaxed);
+	if (live > 0) {
+		raise_to(heap_peak, static_cast<std::uint64_t>(live));
+		raise_to(phase_heap_peaks[i], static_cast<std::uint64_t>(live));
+	}
+	lump_memory& l = lump_usage;
+	++l.allocations;
+	l.bytes += n;
+	l.live += size;
+	l.peak = std::max(l.peak, l.live);
+}
+
+void stats::freed(const std::size_t n) noexcept
+{
+	const auto size = static_cast<std::int64_t>(n);
+	heap_live.fetch_sub(size, std::memory_order_relaxed);
+	lump_usage.live -= size;
+}
+
+stats::timer::timer(const stats::phase p) noexcept
+	: which{p}
+	, on{enabled()}
+{
+	if (!on)
+		return;
+	outer = current_phase;
+	current_phase = p;
+	if (p == phase::grab)
+		lump_usage = {};
+	start = clock::now();
+}
+
+stats::timer::~timer() noexcept
+{
+	if (!on)
+		return;
+	const auto i = index(which);
+	const auto t = static_cast<std::uint64_t>(elapsed().count());
+	phase_times[i].fetch_add(t, std::memory_order_relaxed);
+	phase_counts[i].fetch_add(1, std::memory_order_relaxed);
+	current_phase = outer;
+	if (outer == phase::count && tracking_memory())
+		raise_to(phase_rss[i], sample_rss().rss);
+}
+
+std::chrono::nanoseconds stats::timer::elapsed() const noexcept
+{
+	if (!on)
+		return {};
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock::now() - start);
+}
+
+namespace {
+
+void write_lump_memory(std::ostream& out, const lump_memory& m)
+{
+	out << ",\"allocations\":"sv << m.allocations
+	    << ",\"allocated_bytes\":"sv << m.bytes
+	    << ",\"heap_peak_bytes\":"sv << std::max(m.peak, std::int64_t{0});
+}
+
+// Lumps must be locked
+void write_memory(std::ostream& out)
+{
+	const rss_sample rss = sample_rss();
+	std::uint64_t allocations = 0;
+	std::uint64_t bytes = 0;
+	for (std::size_t i = 0; i < phase_allocations.size(); ++i) {
+		allocations += phase_allocations[i].load();
+		bytes += phase_bytes[i].load();
+	}
+	out << ",\"memory\":{\"allocations\":"sv << allocations
+	    << ",\"allocated_bytes\":"sv << bytes
+	    << ",\"heap_peak_bytes\":"sv << heap_peak.load()
+	    << ",\"rss_kib\":"sv << rss.rss << ",\"rss_peak_kib\":"sv
+	    << rss.hwm << ",\"phases\":{"sv;
+	for (std::size_t i = 0; i < phase_allocations.size(); ++i) {
+		out << (i > 0 ? ","sv : ""sv) << '"' << phase_names[i]
+		    << "\":{\"allocations\":"sv << phase_allocations[i].load()
+		    << ",\"allocated_bytes\":"sv << phase_bytes[i].load()
+		    << ",\"heap_peak_bytes\":"sv << phase_heap_peaks[i].load()
+		    << ",\"rss_kib\":"sv << phase_rss[i].load() << '}';
+	}
+	std::vector<const lump_time*> worst;
+	for (const lump_time& l : lumps)
+		worst.push_back(&l);
+	const auto n = std::min(worst.size(), worst_lumps);
+	std::partial_sort(worst.begin(), worst.begin() + n, worst.end(),
+	                  [](const lump_time* a, const lump_time* b) {
+		return a->memory.peak > b->memory.peak;
+	});
+	out << "},\"worst_lumps\":["sv;
+	for (std::size_t i = 0; i < n; ++i) {
+		out << (i > 0 ? ","sv : ""sv) << "{\"name\":"sv;
+		write_json_string(out, worst[i]->name);
+		write_lump_memory(out, worst[i]->memory);
+		out << '}';
+	}
+	out << "]}"sv;
+}
+
+}
+
+/*
+ * Phase times add up the time of every thread, so with -j they may exceed
+ * the wall time. Lumps are listed in the order they were made.
+ *
+ * The heap peak of a phase is that of the whole program when reached in the
+ * phase, whereas that of a lump only counts what its thread allocated while
+ * grabbing it and has not freed since.
+ */
+void stats::write_json(std::ostream& out)
+{
+	const auto wall = std::chrono::steady_clock::now() - enabled_at;
+	const std::locale loc = out.imbue(std::locale::classic());
+	out << "{\"wall_seconds\":"sv << seconds(wall) << ",\"phases\":{"sv;
+	for (std::size_t i = 0; i < phase_times.size(); ++i) {
+		const std::chrono::nanoseconds t(phase_times[i].load());
+		out << (i > 0 ? ","sv : ""sv) << '"' << phase_names[i]
+		    << "\":{\"seconds\":"sv << seconds(t) << ",\"count\":"sv
+		    << phase_counts[i].load() << '}';
+	}
+	out << "},\"counters\":{"sv;
+	for (std::size_t i = 0; i < counters.size(); ++i) {
+		out << (i > 0 ? ","sv : ""sv) << '"' << counter_names[i]
+		    << "\":"sv << counters[i].load();
+	}
+	out << "},\"peaks\":{"sv;
+	for (std::size_t i = 0; i < peaks.size(); ++i) {
+		out << (i > 0 ? ","sv : ""sv) << '"' << peak_names[i]
+		    << "\":"sv << peaks[i].load();
+	}
+	out << "},\"lumps\":["sv;
+	const std::lock_guard lock(lumps_mutex);
+	for (std::size_t i = 0; i < lumps.size(); ++i) {
+		out << (i > 0 ? ","sv : ""sv) << "{\"name\":"sv;
+		write_json_string(out, lumps[i].name);
+		out << ",\"seconds\":"sv << seconds(lumps[i].time)
+		    << ",\"bytes\":"sv << lumps[i].size;
+		if (tracking_memory())
+			write_lump_memory(out, lumps[i].memory);
+		out << '}';
+	}
+	out << ']';
+	if (tracking_memory())
+		write_memory(out);
+	out << '}' << std::endl;
+	out.imbue(loc);
+}
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+// Process-wide counters reported at the end of a run
+namespace stats {
+
+enum class counter {
+	color_lookups, // one per average_pixels call
+	color_cache_hits,
+	texels_reduced,
+	colors_added,
+	bytes_read,
+	bytes_written,
+	count
+};
+
+// Largest buffers seen, in bytes
+enum class peak {
+	image,
+	lump,
+	wad,
+	count
+};
+
+// Phases may nest: mipmaps are made while grabbing
+enum class phase {
+	parse,
+	load,
+	grab,
+	mipmap,
+	write,
+	count
+};
+
+void add(counter c, std::uint64_t n) noexcept;
+[[nodiscard]] std::uint64_t get(counter c) noexcept;
+
+/*
+ * What follows is only collected once enabled, which --stats does before
+ * anything runs. Until then, it costs a test of a flag.
+ */
+void enable() noexcept;
+[[nodiscard]] bool enabled() noexcept;
+void raise(peak p, std::uint64_t n) noexcept;
+void add_lump(std::string_view name, std::chrono::nanoseconds t,
+              std::size_t size);
+
+/*
+ * Allocation tracking of --memory, fed by the operator new of the sclumpy
+ * program. An allocation is charged to the innermost phase timed on its
+ * thread, and to the lump grabbed on that thread, if any.
+ */
+void track_memory() noexcept;
+[[nodiscard]] bool tracking_memory() noexcept;
+void allocated(std::size_t n) noexcept;
+void freed(std::size_t n) noexcept;
+
+// Adds the time from construction to destruction to a phase, which is the
+// current phase of the thread meanwhile
+class timer {
+public:
+	explicit timer(phase p) noexcept;
+	timer(const timer&) = delete;
+	timer& operator=(const timer&) = delete;
+	~timer() noexcept;
+
+	[[nodiscard]] std::chrono::nanoseconds elapsed() const noexcept;
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	const phase which;
+	const bool on;
+	phase outer = phase::count;
+	clock::time_point start{};
+};
+
+// Everything collected since enable(), as one JSON object
+void write_json(std::ostream& out);
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include <locale>
 #include <stdexcept>
 #include <sstream>
+#include <string>
 #include <string_view>
 
 #include "stringutils.h"
@@ -24,3 +25,12 @@ bool util::compare_nocase(const std::string_view& a, const std::string_view& b)
 	auto cmp = [&loc](char x, char y){ return comp_nc(x, y, loc); };
 	return std::equal(a.cbegin(), a.cend(), b.cbegin(), cmp);
 }
+
+std::string util::lowercase(std::string_view s)
+{
+	const std::locale& loc = std::locale::classic();
+	std::string l(s);
+	for (char& c : l)
+		c = std::tolower(c, loc);
+	return l;
+}
@@ -1,12 +1,16 @@
 #ifndef STRINGUTILS_H
 #define STRINGUTILS_H
 
+#include <string>
 #include <string_view>
 
 namespace util {
 
 bool compare_nocase(const std::string_view &a, const std::string_view &b);
 
+// Lowercase copy, as names are compared in WAD files
+[[nodiscard]] std::string lowercase(std::string_view s);
+
 }
 
 #endif
@@ -9,14 +9,18 @@
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 
 #include "script.h"
 #include "tokenizer.h"
 
 using traits_type = std::char_traits<char>;
 
-script_tokenizer::script_tokenizer(const std::filesystem::path& p)
+script_tokenizer::script_tokenizer(const std::filesystem::path& p,
+                                   std::ostream& l)
 	: info(std::in_place, file_info{p, std::ifstream(p)})
+	, text{}
+	, log{&l}
 {
 	if (info->file.fail()) {
 		std::ostringstream s;
@@ -26,19 +30,42 @@ script_tokenizer::script_tokenizer(const std::filesystem::path& p)
 	}
 }
 
+script_tokenizer::script_tokenizer(std::string t)
+	: info{}
+	, text(std::in_place, std::move(t))
+{}
+
+// In-memory scripts come from servers, which log requests themselves
 script_tokenizer::~script_tokenizer() noexcept
 {
+	if (text)
+		return;
 	using namespace std;
-	const auto ex = cout.exceptions();
-	cout.exceptions(ios_base::goodbit);
+	const auto ex = log->exceptions();
+	log->exceptions(ios_base::goodbit);
 	if (info) {
 		if (current_exception() == nullptr)
-			cout << "Finished script file: " << info->path << endl;
+			*log << "Finished script file: " << info->path << endl;
 	} else {
 		if (current_exception() == nullptr)
-			cout << "Finished standard-input script" << endl;
+			*log << "Finished standard-input script" << endl;
 	}
-	cout.exceptions(ex);
+	log->exceptions(ex);
+}
+
+std::istream& script_tokenizer::stream() noexcept
+{
+	return info ? info->file : text ? *text : std::cin;
+}
+
+void script_tokenizer::describe(std::ostream& s) const
+{
+	if (info)
+		s << "script file " << info->path;
+	else if (text)
+		s << "in-memory script";
+	else
+		s << "standard-input script";
 }
 
 [[nodiscard]]
@@ -59,19 +86,16 @@ static int get_processed_char(std::istream& stream, std::uintmax_t& line)
 
 std::string script_tokenizer::read_quoted_token()
 {
-	std::istream& stream = info ? info->file : std::cin;
+	std::istream& stream = this->stream();
 	std::string token;
 	for (;;) {
 		const int c = get_processed_char(stream, line);
 		if (c == traits_type::eof()) {
 			std::ostringstream s;
 			s << __FILE__ ":" << __func__ << ':'
-			  << __LINE__;
-			if (info)
-				s << ": Script file " << info->path;
-			else
-				s << ": Standard-input script";
-			s << " ended prematurely on line " << line;
+			  << __LINE__ << ": End of ";
+			describe(s);
+			s << " reached prematurely on line " << line;
 			throw std::ifstream::failure(s.str());
 		} else if (c == '"') {
 			return token;
@@ -89,13 +113,10 @@ std::string script_tokenizer::read_token()
 		s << __FILE__ ":" << __func__ << ':' << __LINE__ << ": Locale "
 		  << loc.name()
 		  << " cannot classify characters found in ";
-		if (info)
-			s << "script file: " << info->path;
-		else
-			s << "standard input";
+		describe(s);
 		throw std::logic_error(s.str());
 	}
-	std::istream& stream = info ? info->file : std::cin;
+	std::istream& stream = this->stream();
 	std::string token;
 	// Mealy-machine design
 	int c;
@@ -149,17 +170,15 @@ in_token:
 
 bool script_tokenizer::eof() const
 {
-	return info ? info->file.eof() : std::cin.eof();
+	return info ? info->file.eof() : text ? text->eof() : std::cin.eof();
 }
 
 script::syntax_error
 script_tokenizer::make_syntax_error(std::string_view msg) const
 {
 	std::ostringstream s;
-	if (info)
-		s << "Syntax error in script file " << info->path;
-	else
-		s << "Syntax error in standard-input script";
+	s << "Syntax error in ";
+	describe(s);
 	s << " on line " << line << ": " << msg;
 	return script::syntax_error(__FILE__, __func__, __LINE__,
 	                            s.str().c_str());
@@ -4,7 +4,9 @@
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
 #include <optional>
+#include <sstream>
 #include <string>
 #include <string_view>
 
@@ -12,8 +14,10 @@
 
 class script_tokenizer {
 public:
-	constexpr script_tokenizer() noexcept : info{} {}
-	script_tokenizer(const std::filesystem::path& p);
+	script_tokenizer() noexcept : info{}, text{} {}
+	// Reports to log once the file is read through
+	script_tokenizer(const std::filesystem::path& p, std::ostream& l);
+	explicit script_tokenizer(std::string text);
 	script_tokenizer(const script_tokenizer&) = delete;
 	script_tokenizer& operator=(const script_tokenizer&) = delete;
 	script_tokenizer(script_tokenizer&&) noexcept = default;
@@ -38,8 +42,12 @@ private:
 	};
 
 	[[nodiscard]] std::string read_quoted_token();
+	[[nodiscard]] std::istream& stream() noexcept;
+	void describe(std::ostream& s) const;
 
 	std::optional<file_info> info;
+	std::optional<std::istringstream> text; // neither: standard input
+	std::ostream* log = &std::cout;
 	std::uintmax_t line = 1;
 };
 
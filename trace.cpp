@@ -0,0 +1,134 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <locale>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "json.h"
+#include "trace.h"
+
+using namespace std::literals;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct event {
+	const char* name;
+	std::string detail;
+	clock_type::time_point start;
+	clock_type::time_point end;
+};
+
+// Only its own thread appends to a buffer
+struct buffer {
+	std::size_t thread;
+	bool main;
+	std::vector<event> events{};
+};
+
+std::atomic<bool> active{false};
+clock_type::time_point origin{};
+std::thread::id main_thread{};
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<buffer>> buffers;
+
+// Buffers outlive their threads, which pools may have joined already
+[[nodiscard]] buffer& local_buffer()
+{
+	thread_local buffer* local = nullptr;
+	if (!local) {
+		const std::lock_guard lock(buffers_mutex);
+		const bool main = std::this_thread::get_id() == main_thread;
+		buffers.push_back(std::make_unique<buffer>(
+			buffer{buffers.size() + 1, main}));
+		local = buffers.back().get();
+	}
+	return *local;
+}
+
+[[nodiscard]] double microseconds(clock_type::duration t) noexcept
+{
+	return std::chrono::duration<double, std::micro>(t).count();
+}
+
+}
+
+void trace::enable() noexcept
+{
+	origin = clock_type::now();
+	main_thread = std::this_thread::get_id();
+	active.store(true, std::memory_order_relaxed);
+}
+
+bool trace::enabled() noexcept
+{
+	return active.load(std::memory_order_relaxed);
+}
+
+trace::span::span(const char* n, std::string_view d)
+	: name{n}
+	, on{enabled()}
+{
+	if (!on)
+		return;
+	detail = d;
+	start = clock::now();
+}
+
+trace::span::~span() noexcept
+{
+	if (!on)
+		return;
+	const auto end = clock::now();
+	try {
+		local_buffer().events.push_back({name, std::move(detail), start,
+		                                 end});
+	} catch (...) {
+		// A span missing from the trace is better than no trace
+	}
+}
+
+/*
+ * Spans are complete events ("X"), whose begin and end may not interleave
+ * within a thread, which holds since they are scoped.
+ */
+void trace::write_json(std::ostream& out)
+{
+	std::ostringstream s;
+	s.imbue(std::locale::classic());
+	s << std::fixed << std::setprecision(3) << "{\"traceEvents\":["sv;
+	const std::lock_guard lock(buffers_mutex);
+	bool first = true;
+	for (const auto& b : buffers) {
+		s << (first ? ""sv : ","sv)
+		  << "\n{\"ph\":\"M\",\"pid\":1,\"tid\":"sv << b->thread
+		  << ",\"name\":\"thread_name\",\"args\":{\"name\":"sv;
+		write_json_string(s, b->main ? "main"sv : "worker"sv);
+		s << "}}"sv;
+		first = false;
+		for (const event& e : b->events) {
+			s << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":"sv
+			  << b->thread << ",\"name\":"sv;
+			write_json_string(s, e.name);
+			s << ",\"ts\":"sv << microseconds(e.start - origin)
+			  << ",\"dur\":"sv << microseconds(e.end - e.start);
+			if (!e.detail.empty()) {
+				s << ",\"args\":{\"name\":"sv;
+				write_json_string(s, e.detail);
+				s << '}';
+			}
+			s << '}';
+		}
+	}
+	s << "\n],\"displayTimeUnit\":\"ms\"}\n"sv;
+	out << s.str() << std::flush;
+}
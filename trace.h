@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+/*
+ * Spans of work in the Chrome trace-event format, as shown by chrome://tracing
+ * or Perfetto. Each thread records into its own buffer, so that recording
+ * takes no lock, and the buffers are only read once the run is over.
+ */
+namespace trace {
+
+// Until then, spans cost a test of a flag
+void enable() noexcept;
+[[nodiscard]] bool enabled() noexcept;
+
+// Records the time from construction to destruction under a static name
+class span {
+public:
+	explicit span(const char* name, std::string_view detail = {});
+	span(const span&) = delete;
+	span& operator=(const span&) = delete;
+	~span() noexcept;
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	const char* const name;
+	std::string detail{};
+	const bool on;
+	clock::time_point start{};
+};
+
+// Every span recorded so far, with one thread name per thread
+void write_json(std::ostream& out);
+
+}
+
+#endif
@@ -1,20 +1,35 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <exception>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <limits>
 #include <locale>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "byte.h"
 #include "cmd.h"
+#include "stats.h"
+#include "trace.h"
 #include "wad.h"
 
 using lim = std::numeric_limits<std::int32_t>;
 
 namespace {
 
+constexpr std::size_t max_writing = 2; // shards
+
 class wad_info {
 public:
 	wad_info(std::int32_t nl, std::int32_t ito)
@@ -42,9 +57,11 @@ private:
 	const std::int32_t info_table_offset;
 };
 
-class lump_info {
+}
+
+class wad::writer::entry {
 public:
-	lump_info(const char n[16], std::int32_t fp, std::int32_t len, char t)
+	entry(std::string_view n, std::int32_t fp, std::int32_t len, char t)
 		: filepos(fp)
 		, disksize(len)
 		, size(disksize)
@@ -52,10 +69,18 @@ public:
 		, name{0}
 	{
 		const std::locale loc;
-		for (int i = 0; i < 15 && n[i]; i++)
+		for (std::size_t i = 0; i < 15 && i < n.size() && n[i]; i++)
 			name[i] = std::toupper(n[i], loc);
 	}
 
+	[[nodiscard]] std::size_t offset() const noexcept {
+		return static_cast<std::size_t>(filepos);
+	}
+
+	[[nodiscard]] std::size_t length() const noexcept {
+		return static_cast<std::size_t>(disksize);
+	}
+
 	template<class It>
 	It write(It it, bool big_end) const {
 		static const auto tr = [](const char ch) {
@@ -83,57 +108,171 @@ private:
 	char name[16];
 };
 
-bool big_endian;
-std::filesystem::path output_path;
-std::vector<std::byte> output_buffer;
-std::vector<lump_info> outinfo;
+namespace {
 
-void make(const std::filesystem::path &pathname, bool big_end = false)
+/*
+ * Readers of the WAD file never see it half written, since it is written to
+ * a temporary file renamed over it, which a failure removes.
+ */
+void write_file(const std::filesystem::path& path,
+                const std::vector<std::byte>& bytes)
 {
-	static const auto wadinfo_size = 12;
-	output_path = pathname;
-	output_buffer.resize(wadinfo_size, std::byte{0});
-	outinfo.clear();
-	big_endian = big_end;
+	const trace::span span("write", path.native());
+	const stats::timer timer(stats::phase::write);
+	std::filesystem::path temp = path;
+	temp += ".tmp";
+	try {
+		const auto ptr = reinterpret_cast<const char*>(bytes.data());
+		std::ofstream outwad(temp, std::ios::binary);
+		outwad.write(ptr, static_cast<std::streamsize>(bytes.size()));
+		outwad.close();
+		if (!outwad) {
+			std::ostringstream s;
+			s << __FILE__ ":" << __func__ << ':' << __LINE__
+			  << ": Could not write WAD file " << temp;
+			throw std::ofstream::failure(s.str());
+		}
+		std::filesystem::rename(temp, path);
+	} catch (...) {
+		std::error_code e;
+		std::filesystem::remove(temp, e);
+		throw;
+	}
+	stats::add(stats::counter::bytes_written, bytes.size());
+}
+
 }
 
+wad::writer::writer(std::filesystem::path p, bool w3, bool big_end)
+	: output_path{std::move(p)}
+	, output_buffer(12, std::byte{0})
+	, outinfo{}
+	, wad3{w3}
+	, big_endian{big_end}
+{}
+
+wad::writer::writer(wad::writer&&) noexcept = default;
+wad::writer& wad::writer::operator=(wad::writer&&) noexcept = default;
+wad::writer::~writer() noexcept = default;
+
+std::size_t wad::writer::size() const noexcept
+{
+	return closed_lumps + outinfo.size();
 }
 
-void wad::add(const std::filesystem::path& path, const wad::lump& l, char type)
+void wad::writer::add(const wad::lump& l, char type)
 {
-	static bool output_created = false;
-	if (!std::exchange(output_created, true))
-		make(path);
+	add(l.name(), l.begin(), l.size, type);
+}
 
-	if (outinfo.size() >= 4096) {
+// Lumps are checked before they close a shard, which a rejected one must not
+void wad::writer::add(std::string_view name, const std::byte* data,
+                      std::size_t size, char type)
+{
+	if (name.size() > 15 || size > lump::max_size) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": Lump '" << name << "' has a name longer than 15 or "
+		  << size << " bytes, more than " << lump::max_size;
+		throw std::length_error(s.str());
+	}
+	const std::size_t padded = size + (4 - size % 4) % 4;
+	if (shard_full(padded)) {
+		close_shard();
+		placement.emplace_back();
+	}
+	if (outinfo.size() >= max_lumps) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
 		  << ": Cannot fit more than 4096 lumps in WAD file";
 		throw std::length_error(s.str());
 	}
-	outinfo.emplace_back(l.name_, output_buffer.size(), l.size, type);
+	if (output_buffer.size() > lim::max() - padded) {
+		std::ostringstream s;
+		s << __FILE__ ":" << __func__ << ':' << __LINE__
+		  << ": WAD file is too big";
+		throw std::length_error(s.str());
+	}
+	const std::size_t offset = output_buffer.size();
+	if (sharded())
+		placement.back().emplace_back(name);
 	try {
-		if (output_buffer.size() > lim::max() - l.size) {
-			std::ostringstream s;
-			s << __FILE__ ":" << __func__ << ':' << __LINE__
-			  << ": WAD file is too big";
-			throw std::length_error(s.str());
-		}
-		std::copy(l.begin(), l.end(),
-		          std::back_inserter(output_buffer));
+		output_buffer.insert(output_buffer.end(), data, data + size);
+		output_buffer.resize(offset + padded);
+		if (dedup && add_copy(name, offset, type))
+			return;
+		outinfo.emplace_back(name, offset, padded, type);
 	} catch (...) {
-		outinfo.pop_back();
+		output_buffer.resize(offset);
+		if (sharded())
+			placement.back().pop_back();
 		throw;
 	}
 }
 
-void wad::write()
+std::size_t wad::hash_bytes(const std::byte* data, std::size_t size)
+{
+	const auto chars = reinterpret_cast<const char*>(data);
+	return std::hash<std::string_view>{}({chars, size});
+}
+
+/*
+ * Finds an earlier lump whose data past the first skip bytes matches that
+ * of the lump at the end of the buffer, which starts at the given offset.
+ */
+const wad::writer::entry*
+wad::writer::find_copy(const index_type& index, std::size_t offset,
+                       std::size_t skip) const
+{
+	const std::byte* const data = output_buffer.data() + offset + skip;
+	const std::size_t size = output_buffer.size() - offset - skip;
+	const auto [first, last] = index.equal_range(hash_bytes(data, size));
+	for (auto it = first; it != last; ++it) {
+		if (it->second >= outinfo.size())
+			continue;
+		const entry& e = outinfo[it->second];
+		if (e.length() != size + skip)
+			continue;
+		const auto other = output_buffer.cbegin() + e.offset() + skip;
+		if (std::equal(data, data + size, other))
+			return &e;
+	}
+	return nullptr;
+}
+
+/*
+ * Lumps equal to an earlier one share its data. Miptex lumps begin with their
+ * name, so the ones that only differ by it cannot, and are only counted.
+ */
+bool wad::writer::add_copy(std::string_view name, std::size_t offset,
+                           char type)
+{
+	const std::size_t padded = output_buffer.size() - offset;
+	if (const entry* const e = find_copy(lumps_by_hash, offset, 0)) {
+		outinfo.emplace_back(name, e->offset(), padded, type);
+		output_buffer.resize(offset);
+		++shared_lumps;
+		return true;
+	}
+	const std::byte* const data = output_buffer.data() + offset;
+	const bool miptex = type == type_miptex && padded > 16;
+	if (miptex && find_copy(payloads_by_hash, offset, 16))
+		wasted_bytes += padded;
+	lumps_by_hash.emplace(hash_bytes(data, padded), outinfo.size());
+	if (miptex) {
+		payloads_by_hash.emplace(hash_bytes(data + 16, padded - 16),
+		                         outinfo.size());
+	}
+	return false;
+}
+
+void wad::writer::finish()
 {
 	const auto offset = output_buffer.size();
 
 	{
 		auto it = std::back_inserter(output_buffer);
-		for (const lump_info &x : outinfo)
+		for (const entry &x : outinfo)
 			it = x.write(it, big_endian);
 	}
 		
@@ -146,15 +285,110 @@ void wad::write()
 
 	const wad_info header(static_cast<std::int32_t>(outinfo.size()),
 	                      static_cast<std::int32_t>(offset));
-	header.write(output_buffer.begin(), check_wad3(), big_endian);
-		
-	const auto ptr = reinterpret_cast<const char*>(output_buffer.data());
-	std::ofstream outwad(output_path, std::ios::binary);
-	if (!outwad.write(ptr, output_buffer.size())) {
+	header.write(output_buffer.begin(), wad3, big_endian);
+	stats::raise(stats::peak::wad, output_buffer.size());
+}
+
+std::vector<std::byte> wad::writer::release()
+{
+	finish();
+	outinfo.clear();
+	lumps_by_hash.clear();
+	payloads_by_hash.clear();
+	return std::exchange(output_buffer, std::vector<std::byte>(12));
+}
+
+void wad::writer::write()
+{
+	if (!sharded()) {
+		finish();
+		write_file(output_path, output_buffer);
+		return;
+	}
+	if (!outinfo.empty() || pending.empty())
+		close_shard();
+	// Every shard is waited for before reporting the first failure
+	std::exception_ptr error;
+	for (std::future<void>& f : pending) {
+		try {
+			f.get();
+		} catch (...) {
+			if (!error)
+				error = std::current_exception();
+		}
+	}
+	pending.clear();
+	if (error)
+		std::rethrow_exception(error);
+	write_summary();
+}
+
+void wad::writer::set_shards(std::size_t max_bytes,
+                             std::size_t max_lumps_per_shard) noexcept
+{
+	const auto limit = static_cast<std::size_t>(lim::max());
+	shard_bytes = max_bytes > 0 ? std::min(max_bytes, limit) : limit;
+	shard_lumps = max_lumps_per_shard > 0 ?
+	              std::min(max_lumps_per_shard, max_lumps) : max_lumps;
+	placement.assign(1, {});
+}
+
+bool wad::writer::shard_full(std::size_t padded) const noexcept
+{
+	if (!sharded() || outinfo.empty())
+		return false;
+	const std::size_t bytes = output_buffer.size() + padded;
+	const std::size_t directory = (outinfo.size() + 1) * entry_size;
+	return outinfo.size() >= shard_lumps || bytes > shard_bytes
+	       || directory > shard_bytes - bytes;
+}
+
+std::filesystem::path wad::writer::shard_path(std::size_t i) const
+{
+	std::ostringstream s;
+	s << '_' << std::setw(3) << std::setfill('0') << i;
+	std::filesystem::path p = output_path;
+	p.replace_filename(output_path.stem().native() + s.str());
+	p += output_path.extension();
+	return p;
+}
+
+/*
+ * Starts writing the current shard, leaving the writer empty. Only a few
+ * shards are written at once, which also bounds how many are held in memory;
+ * failures are only reported by write(), once every shard was waited for.
+ */
+void wad::writer::close_shard()
+{
+	finish();
+	if (pending.size() >= max_writing)
+		pending[pending.size() - max_writing].wait();
+	closed_lumps += outinfo.size();
+	outinfo.clear();
+	lumps_by_hash.clear();
+	payloads_by_hash.clear();
+	pending.push_back(std::async(
+		std::launch::async, write_file,
+		shard_path(placement.size() - 1),
+		std::exchange(output_buffer, std::vector<std::byte>(12))));
+}
+
+// One line per lump, with the shard it went to
+void wad::writer::write_summary() const
+{
+	std::filesystem::path p = output_path;
+	p.replace_extension("shards");
+	std::ofstream out(p);
+	for (std::size_t i = 0; i < placement.size(); ++i) {
+		const std::string shard = shard_path(i).filename().string();
+		for (const std::string& name : placement[i])
+			out << name << '\t' << shard << '\n';
+	}
+	out.close();
+	if (!out) {
 		std::ostringstream s;
 		s << __FILE__ ":" << __func__ << ':' << __LINE__
-		  << ": Could not write WAD file";
+		  << ": Could not write shard summary " << p;
 		throw std::ofstream::failure(s.str());
 	}
-	outwad.close();
 }
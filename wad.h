@@ -2,15 +2,28 @@
 #define WAD_H
 
 #include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <future>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace wad {
 
 static constexpr char type_lumpy = 64;
+static constexpr char type_miptex = type_lumpy + 3;
+
+static constexpr std::size_t max_lumps = 4096;
+static constexpr std::size_t entry_size = 32; // in the directory
+static constexpr std::size_t miptex_header_size = 40;
+
+// Hash of lump data, the same for equal bytes in any file
+[[nodiscard]] std::size_t hash_bytes(const std::byte* data, std::size_t size);
 
 class lump {
-	friend void add(const std::filesystem::path&, const lump&, char);
+	friend class writer;
 public:
 	using iterator = const std::byte*;
 
@@ -34,8 +47,193 @@ private:
 	const std::size_t size;
 };
 
-void add(const std::filesystem::path& p, const lump& lmp, char type);
-void write();
+/*
+ * Limits of the miptex lumps the engine loads, and of the pixels of sprays:
+ * https://the303.org/tutorials/goldsrclogoimages/goldsrcchart.png
+ */
+static constexpr std::int32_t max_miptex_side = 1 << 15;
+static constexpr std::int32_t max_miptex_area =
+	static_cast<std::int32_t>((lump::max_size - 810) / 2);
+static constexpr std::int32_t max_spray_area = 12288;
+static constexpr std::int32_t max_sven_spray_area = 14336;
+
+// Why a spray of so many pixels may not load, or nothing if it will
+[[nodiscard]] constexpr std::string_view
+spray_problem(std::int32_t area) noexcept
+{
+	if (area > max_sven_spray_area)
+		return "too much even for Sven Co-op";
+	if (area > max_spray_area)
+		return "valid only for Sven Co-op";
+	return {};
+}
+
+// Assembles a WAD file in memory until it is written
+class writer {
+public:
+	writer(std::filesystem::path p, bool wad3, bool big_end = false);
+	writer(const writer&) = delete;
+	writer& operator=(const writer&) = delete;
+	writer(writer&&) noexcept;
+	writer& operator=(writer&&) noexcept;
+	~writer() noexcept;
+
+	void add(const lump& lmp, char type);
+
+	// Same as adding lump(name, data, size), without the lump buffer
+	void add(std::string_view name, const std::byte* data, std::size_t size,
+	         char type);
+	void write();
+
+	// Gives the WAD file bytes instead of writing them, and starts over
+	[[nodiscard]] std::vector<std::byte> release();
+
+	/*
+	 * Splits the lumps among name_000.wad, name_001.wad and so on, each one
+	 * holding at most so many bytes and lumps, where 0 means as many as a
+	 * WAD file can. Full shards are written in the background, and writing
+	 * the last one also writes name.shards, telling where each lump went.
+	 * Sharded writers are not meant to be released.
+	 */
+	void set_shards(std::size_t max_bytes, std::size_t max_lumps) noexcept;
+
+	[[nodiscard]] bool sharded() const noexcept { return shard_lumps > 0; }
+
+	[[nodiscard]]
+	std::size_t shards() const noexcept { return placement.size(); }
+
+	[[nodiscard]]
+	const std::filesystem::path& path() const noexcept { return output_path; }
+
+	// Lumps added since the last release, in every shard
+	[[nodiscard]] std::size_t size() const noexcept;
+
+	// Lumps identical to earlier ones get directory entries to their data
+	void set_dedup(bool on) noexcept { dedup = on; }
+
+	[[nodiscard]]
+	std::size_t shared() const noexcept { return shared_lumps; }
+
+	// Bytes of miptex lumps that only differ from earlier ones by name
+	[[nodiscard]]
+	std::size_t wasted() const noexcept { return wasted_bytes; }
+
+private:
+	class entry;
+	using index_type = std::unordered_multimap<std::size_t, std::size_t>;
+
+	void finish();
+	void close_shard();
+	[[nodiscard]] bool shard_full(std::size_t padded) const noexcept;
+	[[nodiscard]] std::filesystem::path shard_path(std::size_t i) const;
+	void write_summary() const;
+
+	[[nodiscard]]
+	bool add_copy(std::string_view name, std::size_t offset, char type);
+
+	[[nodiscard]] const entry* find_copy(const index_type& index,
+	                                     std::size_t offset,
+	                                     std::size_t skip) const;
+
+	std::filesystem::path output_path;
+	std::vector<std::byte> output_buffer;
+	std::vector<entry> outinfo;
+	bool wad3;
+	bool big_endian;
+	bool dedup = false;
+	index_type lumps_by_hash{};
+	index_type payloads_by_hash{};
+	std::size_t shared_lumps = 0;
+	std::size_t wasted_bytes = 0;
+	std::size_t shard_bytes = 0;
+	std::size_t shard_lumps = 0;
+	std::size_t closed_lumps = 0;
+	std::vector<std::vector<std::string>> placement{};
+	std::vector<std::future<void>> pending{};
+};
+
+// Read-only view of a WAD file, mapped in memory
+class reader {
+public:
+	struct entry {
+		std::string name;
+		char type;
+		bool compressed;
+		std::size_t offset;
+		std::size_t size; // on disk
+	};
+
+	explicit reader(const std::filesystem::path& p);
+	reader(const reader&) = delete;
+	reader& operator=(const reader&) = delete;
+	~reader() noexcept;
+
+	[[nodiscard]] bool wad3() const noexcept { return is_wad3; }
+
+	[[nodiscard]] const std::filesystem::path& path() const noexcept {
+		return file_path;
+	}
+
+	[[nodiscard]] const std::vector<entry>& entries() const noexcept {
+		return directory;
+	}
+
+	// Whether the data of an entry lies within the file
+	[[nodiscard]] bool in_bounds(const entry& e) const noexcept;
+
+	// Data of an entry, which must be in bounds
+	[[nodiscard]] const std::byte* data(const entry& e) const;
+
+private:
+	std::filesystem::path file_path;
+	const std::byte* bytes = nullptr;
+	std::size_t size = 0;
+	bool is_wad3 = false;
+	std::vector<entry> directory{};
+};
+
+// Miptex lump read from a WAD file, checked to hold everything it points to
+class miptex_view {
+public:
+	miptex_view(const std::byte* data, std::size_t size, bool wad3);
+
+	[[nodiscard]] std::string_view name() const noexcept;
+
+	[[nodiscard]] std::int32_t width() const noexcept { return w; }
+	[[nodiscard]] std::int32_t height() const noexcept { return h; }
+
+	// Offset of a level from the start of the lump
+	[[nodiscard]] std::size_t offset(int lvl) const noexcept {
+		return offsets[lvl];
+	}
+
+	[[nodiscard]] std::size_t level_size(int lvl) const noexcept {
+		return static_cast<std::size_t>(w >> lvl)
+		       * static_cast<std::size_t>(h >> lvl);
+	}
+
+	// Pixels of level 0 to 3
+	[[nodiscard]] const std::byte* level(int lvl) const noexcept {
+		return data + offsets[lvl];
+	}
+
+	// Colors the palette holds, which WAD2 has none of
+	[[nodiscard]] std::size_t colors() const noexcept { return count; }
+
+	// RGB triplets, or null in WAD2
+	[[nodiscard]] const std::byte* palette() const noexcept;
+
+	// Bytes up to the end of the palette, or of level 3 in WAD2
+	[[nodiscard]] std::size_t used() const noexcept;
+
+private:
+	const std::byte* data;
+	std::int32_t w = 0;
+	std::int32_t h = 0;
+	std::size_t offsets[4]{};
+	std::size_t palette_offset = 0; // of its size, 0 in WAD2
+	std::size_t count = 0;
+};
 
 }
 
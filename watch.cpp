@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <map>
+#include <set>
+#include <sstream>
+#include <system_error>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "cmd.h"
+#include "script.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+using namespace std::literals;
+
+namespace {
+
+[[nodiscard]] std::filesystem::path normal(const std::filesystem::path& p)
+{
+	return std::filesystem::absolute(p).lexically_normal();
+}
+
+[[nodiscard]] std::system_error
+system_error(const char* func, unsigned int line, std::string_view what)
+{
+	const int e = errno;
+	std::ostringstream s;
+	s << __FILE__ ":" << func << ':' << line << ": " << what;
+	return std::system_error(e, std::generic_category(), s.str());
+}
+
+/*
+ * Directories are watched rather than files, since editors often save by
+ * renaming a new file over the old one.
+ */
+class watcher {
+public:
+	watcher();
+	watcher(const watcher&) = delete;
+	watcher& operator=(const watcher&) = delete;
+	~watcher() noexcept { ::close(fd); }
+
+	void watch(const std::filesystem::path& file);
+	void clear() noexcept;
+
+	// Files written since the last call, once writes settle down
+	[[nodiscard]] std::set<std::filesystem::path> wait();
+
+private:
+	void read_events(std::set<std::filesystem::path>& changed);
+
+	const int fd;
+	std::map<int, std::filesystem::path> dirs{};
+};
+
+watcher::watcher() : fd{::inotify_init1(IN_CLOEXEC)}
+{
+	if (fd < 0)
+		throw system_error(__func__, __LINE__, "Could not watch"sv);
+}
+
+void watcher::watch(const std::filesystem::path& file)
+{
+	const std::filesystem::path dir = normal(file).parent_path();
+	const auto p = [&dir](const auto& d) { return d.second == dir; };
+	if (std::find_if(dirs.cbegin(), dirs.cend(), p) != dirs.cend())
+		return;
+	const int wd = ::inotify_add_watch(fd, dir.c_str(),
+	                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0)
+		throw system_error(__func__, __LINE__, dir.native());
+	dirs.emplace(wd, dir);
+}
+
+void watcher::clear() noexcept
+{
+	for (const auto& d : dirs)
+		::inotify_rm_watch(fd, d.first);
+	dirs.clear();
+}
+
+void watcher::read_events(std::set<std::filesystem::path>& changed)
+{
+	alignas(inotify_event) char buf[4096];
+	const ssize_t n = ::read(fd, buf, sizeof buf);
+	if (n < 0 && errno == EINTR)
+		return;
+	if (n < 0)
+		throw system_error(__func__, __LINE__, "Could not read"sv);
+	for (ssize_t i = 0; i < n;) {
+		const auto ev = reinterpret_cast<const inotify_event*>(buf + i);
+		const auto it = dirs.find(ev->wd);
+		if (it != dirs.end() && ev->len > 0)
+			changed.insert(it->second / ev->name);
+		i += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
+	}
+}
+
+std::set<std::filesystem::path> watcher::wait()
+{
+	std::set<std::filesystem::path> changed;
+	pollfd p{fd, POLLIN, 0};
+	while (changed.empty())
+		read_events(changed);
+	// Saving a file may take several writes, or several files
+	while (::poll(&p, 1, 20) > 0)
+		read_events(changed);
+	return changed;
+}
+
+// Where the lumps go, in the order they are grabbed
+template<class It>
+[[nodiscard]] std::vector<std::filesystem::path> destinations(It first,
+                                                              It last)
+{
+	std::vector<std::filesystem::path> dests;
+	for (; first != last; ++first) {
+		for (const script::grab& l : (*first)->lumps) {
+			if (std::find(dests.cbegin(), dests.cend(), l.dest)
+			    == dests.cend())
+				dests.push_back(l.dest);
+		}
+	}
+	return dests;
+}
+
+[[nodiscard]] std::vector<const script::image_grabs*>
+all_images(const script::recording& rec)
+{
+	std::vector<const script::image_grabs*> images;
+	for (const script::image_grabs& g : rec.images)
+		images.push_back(&g);
+	return images;
+}
+
+void watch_recording(watcher& w, const script::recording& rec)
+{
+	w.clear();
+	for (const std::filesystem::path& p : rec.scripts)
+		w.watch(p);
+	for (const script::image_grabs& g : rec.images) {
+		if (!g.source.empty())
+			w.watch(expand(g.source));
+	}
+}
+
+[[nodiscard]] script::recording record(const std::filesystem::path& in,
+                                       const std::filesystem::path& out)
+{
+	script::recording rec = script::record_from_path(in, out);
+	const auto images = all_images(rec);
+	script::write_recording(rec, destinations(images.cbegin(),
+	                                          images.cend()));
+	return rec;
+}
+
+// Grabs again the lumps of the changed images and writes their WAD files
+[[nodiscard]] std::size_t
+regrab_changed(script::recording& rec,
+               const std::set<std::filesystem::path>& changed)
+{
+	std::vector<script::image_grabs*> images;
+	std::size_t lumps = 0;
+	for (script::image_grabs& g : rec.images) {
+		if (g.source.empty()
+		    || changed.count(normal(expand(g.source))) == 0)
+			continue;
+		images.push_back(&g);
+		lumps += g.lumps.size();
+	}
+	const auto regrab = [&images](std::size_t i) {
+		script::regrab(*images[i]);
+	};
+	for_each_job(images.size(), regrab);
+	script::write_recording(rec, destinations(images.cbegin(),
+	                                          images.cend()));
+	return lumps;
+}
+
+}
+
+/*
+ * Lumps only depend on the image they are grabbed from, so a changed image
+ * only has its own lumps grabbed again, while the others are kept from the
+ * last run. A changed script is run again from the start.
+ */
+void run_watch(const std::filesystem::path& in,
+               const std::filesystem::path& out)
+{
+	using clock = std::chrono::steady_clock;
+
+	watcher w;
+	script::recording rec = record(in, out);
+	watch_recording(w, rec);
+	std::cout << "Watching "sv << rec.scripts.size() << " scripts and "sv
+	          << rec.images.size() - 1 << " images"sv << std::endl;
+	for (;;) {
+		const std::set<std::filesystem::path> changed = w.wait();
+		const auto start = clock::now();
+		const auto p = [&changed](const std::filesystem::path& s) {
+			return changed.count(normal(s)) > 0;
+		};
+		try {
+			if (std::any_of(rec.scripts.cbegin(),
+			                rec.scripts.cend(), p)) {
+				rec = record(in, out);
+				watch_recording(w, rec);
+				continue;
+			}
+			const std::size_t n = regrab_changed(rec, changed);
+			if (n == 0)
+				continue;
+			const auto t = clock::now() - start;
+			const auto ms = std::chrono::duration<double,
+			                                      std::milli>(t);
+			std::cout << "Grabbed "sv << n << " lumps again in "sv
+			          << ms.count() << " ms"sv << std::endl;
+		} catch (const std::exception& e) {
+			std::cout << "Could not rebuild:\n"sv << e.what()
+			          << std::endl;
+		}
+	}
+}
+
+#else
+
+void run_watch([[maybe_unused]] const std::filesystem::path& in,
+               [[maybe_unused]] const std::filesystem::path& out)
+{
+	throw std::logic_error("Watch mode needs inotify, which is Linux-only");
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <filesystem>
+
+// Rebuilds the lumps of a script whenever it or an image it loads changes
+void run_watch(const std::filesystem::path& in,
+               const std::filesystem::path& out);
+
+#endif